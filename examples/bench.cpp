@@ -0,0 +1,283 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+/// # bench
+///
+/// Run a script of SQL statements over and over from a number of client
+/// coroutines spread across a number of threads, and report the throughput
+/// and the latency distribution of the script executions.
+
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <pgasio/buffered.hpp>
+#include <pgasio/partitioned.hpp>
+#include <pgasio/query.hpp>
+
+
+/// How the statements are sent to Postgres
+enum class mode {
+    /// Each statement is sent using the simple query protocol and its
+    /// results are read before the next is sent
+    simple,
+    /// Each statement is prepared the first time it is used and then
+    /// executed through the connection's statement cache
+    prepared,
+    /// All of the statements in the script are sent in one write and then
+    /// the results are read
+    pipelined
+};
+
+
+/// Split the SQL into statements at the semi-colons, dropping comment lines
+std::vector<std::string> statements(const std::string &sql);
+
+/// Execute the script once, reading all of the results
+template<typename S, typename Y>
+void execute(pgasio::connection<S> &cnx, mode m, const std::vector<std::string> &script, Y yield);
+
+/// Display a latency in microseconds
+std::string micros(std::chrono::nanoseconds);
+
+
+int main(int argc, char *argv[]) {
+    std::cerr << "pgasio benchmark" << std::endl;
+
+    /// The parameters we need to use.
+    const char *user = std::getenv("LOGNAME");
+    const char *database = nullptr;
+    const char *path = "/var/run/postgresql/.s.PGSQL.5432";
+    std::size_t clients = 1, threads = 1, transactions = 0;
+    std::chrono::seconds duration{10};
+    double rate = 0;
+    mode protocol = mode::simple;
+    std::vector<std::string> script;
+
+    /// Go through the command line and pull the details out
+    for ( auto a{1}; a < argc; ++a ) {
+        using namespace std::string_literals;
+        auto read_opt = [&](char opt) {
+            if ( ++a >= argc ) throw std::runtime_error("Missing option after -"s + opt);
+            return argv[a];
+        };
+        if ( argv[a] == "-c"s ) {
+            clients = std::stoul(read_opt('c'));
+        } else if ( argv[a] == "-d"s ) {
+            database = read_opt('d');
+        } else if ( argv[a] == "-h"s ) {
+            path = read_opt('h');
+        } else if ( argv[a] == "-j"s ) {
+            threads = std::stoul(read_opt('j'));
+        } else if ( argv[a] == "-M"s ) {
+            const std::string m = read_opt('M');
+            if ( m == "simple" ) {
+                protocol = mode::simple;
+            } else if ( m == "prepared" ) {
+                protocol = mode::prepared;
+            } else if ( m == "pipelined" ) {
+                protocol = mode::pipelined;
+            } else {
+                std::cerr << "Unknown mode: " << m << std::endl;
+                return 2;
+            }
+        } else if ( argv[a] == "-R"s ) {
+            rate = std::stod(read_opt('R'));
+        } else if ( argv[a] == "-s"s ) {
+            script.emplace_back(read_opt('s'));
+        } else if ( argv[a] == "-T"s ) {
+            duration = std::chrono::seconds{std::stoul(read_opt('T'))};
+        } else if ( argv[a] == "-t"s ) {
+            transactions = std::stoul(read_opt('t'));
+        } else if ( argv[a] == "-U"s ) {
+            user = read_opt('U');
+        } else if ( argv[a][0] == '-' ) {
+            std::cerr << "Unknown command line option: "s + argv[a] << std::endl;
+            return 2;
+        } else {
+            std::ifstream file(argv[a]);
+            std::string content;
+            for ( char c{}; file.get(c); content += c );
+            if ( content.empty() ) {
+                std::cerr << "File " << argv[a] << " was empty, or could not be read" << std::endl;
+            } else {
+                for ( auto &s : statements(content) ) script.push_back(std::move(s));
+            }
+        }
+    }
+    if ( script.empty() ) script.emplace_back("SELECT 1");
+    if ( user == nullptr ) {
+        std::cerr << "No user name was given, use -U" << std::endl;
+        return 2;
+    }
+    if ( not clients || not threads ) {
+        std::cerr << "There must be at least one client and one thread" << std::endl;
+        return 2;
+    }
+
+    /// The latencies of every script execution across all of the clients
+    std::mutex mutex;
+    std::vector<std::chrono::nanoseconds> latencies;
+    std::size_t failures{};
+
+    boost::asio::io_service ios;
+    const auto started = std::chrono::steady_clock::now();
+    const auto finish = started + duration;
+    for ( std::size_t client{}; client < clients; ++client ) {
+        boost::asio::spawn(ios, [&, client](auto yield) {
+            std::vector<std::chrono::nanoseconds> mine;
+            std::size_t failed{};
+            try {
+                auto cnx = pgasio::handshake(
+                    pgasio::make_buffered(pgasio::unix_domain_socket(ios, path, yield)),
+                    user, database, yield);
+                if ( protocol == mode::prepared ) cnx.statements.capacity(script.size());
+
+                /// For a fixed rate the executions are scheduled at random
+                /// intervals (a Poisson process) and the latency is measured
+                /// from when the execution was due. This way a slow server
+                /// can't hide its latency by holding up the next execution.
+                std::mt19937_64 random{client};
+                std::exponential_distribution<double> interval{rate > 0 ? rate / clients : 1.0};
+                boost::asio::steady_timer timer{ios};
+                auto due = std::chrono::steady_clock::now();
+
+                while ( transactions ? mine.size() + failed < transactions
+                        : std::chrono::steady_clock::now() < finish ) {
+                    if ( rate > 0 ) {
+                        due += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                            std::chrono::duration<double>{interval(random)});
+                        if ( not transactions && due >= finish ) break;
+                        timer.expires_at(due);
+                        timer.async_wait(yield);
+                    } else {
+                        due = std::chrono::steady_clock::now();
+                    }
+                    try {
+                        execute(cnx, protocol, script, yield);
+                        mine.push_back(std::chrono::steady_clock::now() - due);
+                    } catch ( pgasio::postgres_error &e ) {
+                        ++failed;
+                    }
+                }
+            } catch ( std::exception &e ) {
+                std::cerr << "Client " << client << " failed: " << e.what() << std::endl;
+            }
+            std::unique_lock<std::mutex> lock{mutex};
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+            failures += failed;
+        });
+    }
+    pgasio::run_threads(ios, threads);
+    const auto elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - started).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        if ( latencies.empty() ) return std::chrono::nanoseconds{};
+        const auto index = std::size_t(p * (latencies.size() - 1) + 0.5);
+        return latencies[index];
+    };
+    std::chrono::nanoseconds total{};
+    for ( auto l : latencies ) total += l;
+
+    std::cout << "Clients: " << clients << " threads: " << threads << " mode: "
+        << (protocol == mode::simple ? "simple" :
+            protocol == mode::prepared ? "prepared" : "pipelined")
+        << "\nStatements per transaction: " << script.size()
+        << "\nTransactions: " << latencies.size() << " failed: " << failures
+        << "\nTime: " << elapsed << "s"
+        << "\nTransactions per second: " << (latencies.size() / elapsed)
+        << "\nLatency (microseconds):";
+    if ( latencies.size() ) {
+        std::cout << "\n  mean: " << micros(total / latencies.size())
+            << "\n  p50:  " << micros(percentile(0.5))
+            << "\n  p99:  " << micros(percentile(0.99))
+            << "\n  p999: " << micros(percentile(0.999))
+            << "\n  max:  " << micros(latencies.back());
+    }
+    std::cout << std::endl;
+
+    return 0;
+}
+
+
+std::vector<std::string> statements(const std::string &sql) {
+    std::vector<std::string> found;
+    std::string current;
+    auto add = [&]() {
+        const auto start = current.find_first_not_of(" \t\r\n");
+        if ( start != std::string::npos ) {
+            found.push_back(current.substr(start, current.find_last_not_of(" \t\r\n") + 1 - start));
+        }
+        current.clear();
+    };
+    std::size_t line{};
+    while ( line < sql.size() ) {
+        auto end = sql.find('\n', line);
+        if ( end == std::string::npos ) end = sql.size();
+        const auto text = sql.substr(line, end - line);
+        const auto first = text.find_first_not_of(" \t");
+        if ( first == std::string::npos || text.compare(first, 2, "--") != 0 ) {
+            for ( auto c : text ) {
+                if ( c == ';' ) {
+                    add();
+                } else {
+                    current += c;
+                }
+            }
+            current += '\n';
+        }
+        line = end + 1;
+    }
+    add();
+    return found;
+}
+
+
+template<typename S, typename Y>
+void execute(pgasio::connection<S> &cnx, mode m, const std::vector<std::string> &script, Y yield) {
+    auto drain = [&](auto &results) {
+        while ( auto rs = results.recordset(yield) ) {
+            while ( rs.next_block(yield) );
+        }
+    };
+    if ( m == mode::pipelined ) {
+        std::vector<pgasio::resultset<S>> results;
+        results.reserve(script.size());
+        for ( const auto &sql : script ) results.push_back(pgasio::queue_query(cnx, sql));
+        pgasio::flush(cnx, yield);
+        /// Every reply must be read, even after an error, so that the
+        /// connection stays in step with Postgres
+        std::exception_ptr error;
+        for ( auto &r : results ) {
+            try {
+                drain(r);
+            } catch ( pgasio::postgres_error & ) {
+                if ( not error ) error = std::current_exception();
+            }
+        }
+        if ( error ) std::rethrow_exception(error);
+    } else {
+        for ( const auto &sql : script ) {
+            auto results = pgasio::query(cnx, sql, yield);
+            drain(results);
+        }
+    }
+}
+
+
+std::string micros(std::chrono::nanoseconds ns) {
+    const auto us = std::chrono::duration<double, std::micro>(ns).count();
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.1f", us);
+    return buffer;
+}
@@ -4,53 +4,18 @@
 
 
 #include <cstdlib>
-#include <experimental/iterator>
 #include <iostream>
 #include <string>
 
-#include <f5/threading/channel.hpp>
+#include <unistd.h>
+
 #include <f5/threading/reactor.hpp>
 #include <f5/threading/sync.hpp>
 
-#include <pgasio/buffered.hpp>
-#include <pgasio/query.hpp>
-
+#include <boost/asio/posix/stream_descriptor.hpp>
 
-/// Append safe data (numeric so nothing to do)
-std::string &safe_data(std::string &str, pgasio::byte_view text) {
-    return str.append(reinterpret_cast<const char *>(text.data()), text.size());
-}
-/// Append a safe string (no weird JSON escaping needed)
-std::string &safe_string(std::string &str, pgasio::byte_view text) {
-    return safe_data(str += '"', text) += '"';
-}
-/// Append an unsafe string (with escaping)
-std::string &json_string(std::string &str, pgasio::byte_view text) {
-    str += '"';
-    while ( text.size() ) {
-        switch ( text[0] ) {
-        case '\n':
-            str += "\\n";
-            break;
-        case '\r':
-            str += "\\r";
-            break;
-        case '\t':
-            str += "\\t";
-            break;
-        case '\\':
-            str += "\\\\";
-            break;
-        case '\"':
-            str += "\\\"";
-            break;
-        default:
-            str += text[0];
-        }
-        text = text.slice(1);
-    }
-    return str += '"';
-}
+#include <pgasio/buffered.hpp>
+#include <pgasio/serialise.hpp>
 
 
 int main(int argc, char *argv[]) {
@@ -61,6 +26,7 @@ int main(int argc, char *argv[]) {
     const char *database = nullptr;
     const char *path = "/var/run/postgresql/.s.PGSQL.5432";
     const char *sql = nullptr;
+    auto format = pgasio::text_format::csj;
 
     /// Go through the command line and pull the details out
     for ( auto a{1}; a < argc; ++a ) {
@@ -71,6 +37,16 @@ int main(int argc, char *argv[]) {
         };
         if ( argv[a] == "-d"s ) {
             database = read_opt('d');
+        } else if ( argv[a] == "-f"s ) {
+            const auto f = read_opt('f');
+            if ( f == "csv"s ) {
+                format = pgasio::text_format::csv;
+            } else if ( f == "ndjson"s ) {
+                format = pgasio::text_format::ndjson;
+            } else if ( f != "csj"s ) {
+                std::cerr << "Unknown output format: " << f << std::endl;
+                return 2;
+            }
         } else if ( argv[a] == "-h"s ) {
             path = read_opt('h');
         } else if ( argv[a] == "-U"s ) {
@@ -89,107 +65,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    /// Set up the reactor thread pool and the channels we'll need
+    /// Set up the reactor thread pool
     f5::boost_asio::reactor_pool reactor{[]() {
         std::cerr << "An error occured\n";
         std::exit(2);
         return false;
     }};
-    struct rblock {
-        pgasio::array_view<const pgasio::column_meta> columns;
-        pgasio::record_block block;
-    };
-    auto blocks = std::make_shared<
-        f5::boost_asio::channel<rblock>>(reactor.get_io_service(), reactor.size());
-    auto csj = std::make_shared<
-        f5::boost_asio::channel<std::string>>(reactor.get_io_service(), reactor.size());
 
-    /// Database conversation coroutine
-    boost::asio::spawn(reactor.get_io_service(), [=, &reactor](auto yield) {
+    /// Database conversation coroutine. The conversion of the blocks to
+    /// text is spread over all of the reactor threads and the text is
+    /// written to stdout in order.
+    f5::sync s;
+    boost::asio::spawn(reactor.get_io_service(), s([&](auto yield) {
         auto cnx = pgasio::handshake(
             pgasio::make_buffered(pgasio::unix_domain_socket(reactor.get_io_service(), path, yield)),
             user, database, yield);
+        /// Lets domains, e.g. over numbers, be written the same way as
+        /// their base types
+        pgasio::load_types(cnx, yield);
         auto results = pgasio::query(cnx, sql, yield);
         auto records = results.recordset(yield);
-        auto comma = std::experimental::make_ostream_joiner(std::cout, ",");
-        for ( const auto &col : records.columns() ) {
-            std::string escaped;
-            json_string(escaped, pgasio::byte_view(
-                reinterpret_cast<const unsigned char *>(col.name.data()), col.name.size()));
-            *comma++ = escaped;
-        }
-        std::cout << std::endl;
-        while ( cnx.socket.is_open() ) {
-            auto block = records.next_block(yield);
-            const bool good = block;
-            blocks->produce({records.columns(), std::move(block)}, yield);
-            if ( not good ) return;
-        }
-    });
-
-    /// Workers for converting the raw data into CSJ
-    boost::asio::spawn(reactor.get_io_service(), [blocks, csj](auto yield) {
-        while ( true ) {
-            auto batch = blocks->consume(yield);
-            if ( batch.block ) {
-                std::string text;
-                text.reserve(batch.block.used_bytes());
-                for ( auto cols = batch.block.fields(); cols.size(); cols = cols.slice(batch.columns.size()) ) {
-                    for ( std::size_t index{}; index < batch.columns.size(); ++index ) {
-                        if ( index ) text += ',';
-                        if ( cols[index].data() == nullptr ) {
-                            text += "null";
-                        } else {
-                            switch ( batch.columns[index].field_type_oid ) {
-                            case 16: // bool
-                                text += cols[index][0] == 't' ? "true" : "false";
-                                break;
-                            case 21: // int2
-                            case 23: // int4
-                            case 20: // int8
-                            case 26: // oid
-                            case 700: // float4
-                            case 701: // float8
-                                safe_data(text, cols[index]);
-                                break;
-                            case 114: // json
-                            case 1700: // numeric
-                            case 1082: // date
-                            case 1083: // time
-                            case 1114: // timestamp without time zone
-                            case 1184: // timestamp with time zone
-                            case 2950: // uuid
-                            case 3802: // jsonb
-                                safe_string(text, cols[index]);
-                                break;
-                            default:
-                                text += "**** " +
-                                    std::to_string(batch.columns[index].field_type_oid) +" **** ";
-                            case 25: // text
-                            case 1042: // bpchar
-                            case 1043: // varchar
-                                json_string(text, cols[index]);
-                            }
-                        }
-                    }
-                    text += '\n';
-                }
-                csj->produce(text, yield);
-            } else {
-                csj->produce(std::string(), yield);
-                return;
-            }
-        }
-    });
-
-    /// Write the CSJ blocks out to stdout in the right order
-    f5::sync s;
-    boost::asio::spawn(reactor.get_io_service(), s([csj](auto yield) {
-        while ( true ) {
-            auto chunk = csj->consume(yield);
-            if ( chunk.empty() ) return;
-            std::cout << chunk;
-        }
+        boost::asio::posix::stream_descriptor out{
+            reactor.get_io_service(), ::dup(STDOUT_FILENO)};
+        pgasio::write_recordset(reactor.get_io_service(), records, format, out,
+            reactor.size(), yield);
     }));
     s.wait();
 
@@ -13,6 +13,7 @@
 #include <fstream>
 #include <iostream>
 
+#include <pgasio/aggregate.hpp>
 #include <pgasio/buffered.hpp>
 #include <pgasio/query.hpp>
 
@@ -21,10 +22,11 @@
 struct col_stats {
     pgasio::column_meta meta;
 
-    std::size_t nulls{}, not_nulls{};
-    std::size_t size{};
+    pgasio::field_summary fields;
+    pgasio::numeric_summary<int64_t> integers;
+    pgasio::numeric_summary<double> floats;
 
-    void operator () (pgasio::byte_view);
+    void operator () (const pgasio::record_block &, std::size_t column);
 };
 /// Store statistics about a single recordset we get back
 struct stats {
@@ -109,17 +111,13 @@ int main(int argc, char *argv[]) {
                 while ( auto rs = results.recordset(yield) ) {
                     stats rs_stats;
                     for ( auto &&col : rs.columns() ) {
-                        rs_stats.cols.push_back(col_stats{col});
+                        rs_stats.cols.push_back(col_stats{col, {}, {}, {}});
                     }
                     while ( auto block = rs.next_block(yield) ) {
                         ++rs_stats.blocks;
-                        for ( auto fields = block.fields(); fields.size();
-                            fields = fields.slice(rs.columns().size()) )
-                        {
-                            for ( std::size_t col{}; col < rs_stats.cols.size(); ++col ) {
-                                rs_stats.cols[col](fields[col]);
-                            }
-                            ++rs_stats.rows;
+                        rs_stats.rows += block.fields().size() / block.columns();
+                        for ( std::size_t col{}; col < rs_stats.cols.size(); ++col ) {
+                            rs_stats.cols[col](block, col);
                         }
                     }
                     rs_stats.done();
@@ -155,12 +153,17 @@ int main(int argc, char *argv[]) {
 
 
 /// Implementations of statistics gathering
-void col_stats::operator () (pgasio::byte_view field) {
-    if ( field.data() == nullptr ) {
-        ++nulls;
-    } else {
-        ++not_nulls;
-        size += field.size();
+void col_stats::operator () (const pgasio::record_block &block, std::size_t column) {
+    fields += pgasio::summarise(block, column);
+    switch ( pgasio::numeric_kind_for(meta.field_type_oid) ) {
+    case pgasio::numeric_kind::none:
+        break;
+    case pgasio::numeric_kind::integer:
+        integers += pgasio::summarise_numeric<int64_t>(block, column, meta);
+        break;
+    case pgasio::numeric_kind::floating:
+        floats += pgasio::summarise_numeric<double>(block, column, meta);
+        break;
     }
 }
 
@@ -187,11 +190,20 @@ template<class Ch, class Tr, class... Args>
 auto operator << (std::basic_ostream<Ch, Tr>& os, const col_stats &s)
     -> std::basic_ostream<Ch, Tr>&
 {
-    const auto rows = s.nulls + s.not_nulls;
+    const auto rows = s.fields.values;
     os << "  " << s.meta.name << ": oid=" << s.meta.field_type_oid
-        << "\n    null: " << s.nulls << '/' << rows << " not null: " << s.not_nulls
-        << "\n    size: total=" << s.size;
-    if ( rows ) os << " mean=" << (double(s.size)/rows);
+        << "\n    null: " << s.fields.nulls << '/' << rows
+        << " not null: " << (rows - s.fields.nulls)
+        << "\n    size: total=" << s.fields.bytes;
+    if ( rows ) os << " mean=" << (double(s.fields.bytes)/rows);
+    auto numbers = [&os](const auto &n) {
+        if ( n.count ) {
+            os << "\n    values: sum=" << n.sum << " min=" << n.min << " max=" << n.max
+                << " mean=" << (double(n.sum) / n.count);
+        }
+    };
+    numbers(s.integers);
+    numbers(s.floats);
     return os;
 }
 template<class Ch, class Tr, class... Args>
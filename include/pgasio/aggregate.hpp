@@ -0,0 +1,451 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/binary.hpp>
+#include <pgasio/channel.hpp>
+#include <pgasio/query.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <mutex>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+namespace pgasio {
+
+
+    /// Counts of the values in a column
+    struct field_summary {
+        /// The number of fields, including the `NULL`s
+        std::size_t values{};
+        std::size_t nulls{};
+        /// The total length of the non-`NULL` values in bytes
+        std::size_t bytes{};
+
+        field_summary &operator += (const field_summary &s) {
+            values += s.values;
+            nulls += s.nulls;
+            bytes += s.bytes;
+            return *this;
+        }
+    };
+
+
+    /// The count, sum, minimum and maximum of the non-`NULL` values in a
+    /// numeric column. Summaries of different blocks are merged using `+=`.
+    template<typename T>
+    struct numeric_summary {
+        std::size_t count{};
+        T sum{};
+        T min = std::numeric_limits<T>::has_infinity ?
+            std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+        T max = std::numeric_limits<T>::has_infinity ?
+            -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+
+        /// Add a single value. A `NaN` is counted and added to the sum, but
+        /// doesn't change the minimum or maximum.
+        void operator () (T v) {
+            ++count;
+            sum += v;
+            min = std::min(min, v);
+            max = std::max(max, v);
+        }
+
+        numeric_summary &operator += (const numeric_summary &s) {
+            count += s.count;
+            sum += s.sum;
+            min = std::min(min, s.min);
+            max = std::max(max, s.max);
+            return *this;
+        }
+    };
+
+
+    /// How a column's values are read for a `numeric_summary`
+    enum class numeric_kind {
+        /// Not a numeric type that can be summarised
+        none,
+        /// `int2`, `int4`, `int8` and `oid`, summarised as `int64_t`
+        integer,
+        /// `float4` and `float8`, summarised as `double`
+        floating
+    };
+    inline numeric_kind numeric_kind_for(int32_t oid) {
+        switch ( oid ) {
+        case 20: // int8
+        case 21: // int2
+        case 23: // int4
+        case 26: // oid
+            return numeric_kind::integer;
+        case 700: // float4
+        case 701: // float8
+            return numeric_kind::floating;
+        default:
+            return numeric_kind::none;
+        }
+    }
+
+
+    namespace aggregate_detail {
+
+
+        static_assert(sizeof(byte_view) == 2 * sizeof(int64_t),
+            "The kernels read a byte_view as a data pointer followed by a size");
+
+
+        template<typename V>
+        V from_text(byte_view field) {
+            V v{};
+            const auto begin = reinterpret_cast<const char *>(field.data());
+            const auto [ptr, ec] = std::from_chars(begin, begin + field.size(), v);
+            if ( ec != std::errc{} || ptr != begin + field.size() ) {
+                throw std::runtime_error("Could not parse the numeric field text: " +
+                    std::string(begin, begin + field.size()));
+            }
+            return v;
+        }
+
+        template<typename T>
+        T from_binary(byte_view field, int32_t oid) {
+            switch ( oid ) {
+            case 20: return T(binary_value<int64_t>(field));
+            case 21: return T(binary_value<int16_t>(field));
+            case 23: return T(binary_value<int32_t>(field));
+            case 26: return T(binary_value<uint32_t>(field));
+            case 700: return T(binary_value<float>(field));
+            case 701: return T(binary_value<double>(field));
+            default: throw std::invalid_argument("Not a numeric type: " + std::to_string(oid));
+            }
+        }
+
+
+#if defined(__AVX2__)
+        /// The indexes (counted in 64 bit words) of the data pointers for
+        /// four rows of a column
+        inline __m256i row_indexes(std::size_t column, std::size_t columns) {
+            const long long stride = 2 * columns, first = 2 * column;
+            return _mm256_set_epi64x(
+                first + 3 * stride, first + 2 * stride, first + stride, first);
+        }
+        inline int64_t horizontal_sum(__m256i v) {
+            alignas(32) int64_t lanes[4];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), v);
+            return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+
+        /// Load four big endian values from the data pointers
+        /// of the lanes that are set in `valid`. Integers are sign extended
+        /// (except `oid`s) and `float4` values are widened to `float8`.
+        inline __m256i load_big_endian(__m256i pointers, __m256i valid, int32_t oid) {
+            const auto base = static_cast<const long long *>(nullptr);
+            if ( oid == 20 || oid == 701 ) {
+                const auto reverse = _mm256_set_epi8(
+                    8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                    8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+                return _mm256_shuffle_epi8(_mm256_mask_i64gather_epi64(
+                    _mm256_setzero_si256(), base, pointers, valid, 1), reverse);
+            } else {
+                const auto reverse = _mm_set_epi8(
+                    12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+                const auto words = _mm_shuffle_epi8(_mm256_mask_i64gather_epi32(
+                    _mm_setzero_si128(), reinterpret_cast<const int *>(base), pointers,
+                    _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+                        valid, _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0))), 1), reverse);
+                switch ( oid ) {
+                case 23: return _mm256_cvtepi32_epi64(words);
+                case 26: return _mm256_cvtepu32_epi64(words);
+                default: return _mm256_castpd_si256(_mm256_cvtps_pd(_mm_castsi128_ps(words)));
+                }
+            }
+        }
+#endif
+
+
+    }
+
+
+    /// Count the values, `NULL`s and bytes in one column of the block
+    inline field_summary summarise(const record_block &block, std::size_t column) {
+        const auto fields = block.fields();
+        const auto columns = block.columns();
+        field_summary summary;
+        if ( not columns ) return summary;
+        assert(column < columns);
+        const std::size_t rows = fields.size() / columns;
+        summary.values = rows;
+        std::size_t row{};
+#if defined(__AVX2__)
+        {
+            using namespace aggregate_detail;
+            const auto words = reinterpret_cast<const long long *>(fields.data());
+            auto index = row_indexes(column, columns);
+            const auto step = _mm256_set1_epi64x(8 * columns);
+            auto nulls = _mm256_setzero_si256(), bytes = _mm256_setzero_si256();
+            const auto one = _mm256_set1_epi64x(1);
+            for ( ; row + 4 <= rows; row += 4 ) {
+                const auto pointers = _mm256_i64gather_epi64(words, index, 8);
+                /// `NULL`s have a size of zero so all of the sizes can be added
+                bytes = _mm256_add_epi64(bytes, _mm256_i64gather_epi64(
+                    words, _mm256_add_epi64(index, one), 8));
+                nulls = _mm256_sub_epi64(nulls,
+                    _mm256_cmpeq_epi64(pointers, _mm256_setzero_si256()));
+                index = _mm256_add_epi64(index, step);
+            }
+            summary.nulls = horizontal_sum(nulls);
+            summary.bytes = horizontal_sum(bytes);
+        }
+#endif
+        for ( ; row < rows; ++row ) {
+            const auto field = fields[row * columns + column];
+            if ( field.data() == nullptr ) {
+                ++summary.nulls;
+            } else {
+                summary.bytes += field.size();
+            }
+        }
+        return summary;
+    }
+
+
+    /// Sum the values and find the minimum and maximum in one numeric column
+    /// of the block. `T` is `int64_t` for integer columns and `double` for
+    /// floating point columns. Both text and binary formats can be read.
+    template<typename T>
+    numeric_summary<T> summarise_numeric(
+        const record_block &block, std::size_t column, const column_meta &meta
+    ) {
+        const auto oid = meta.field_type_oid;
+        if ( numeric_kind_for(oid) == numeric_kind::none ) {
+            throw std::invalid_argument("Column isn't numeric: " + meta.name);
+        }
+        const auto fields = block.fields();
+        const auto columns = block.columns();
+        numeric_summary<T> summary;
+        if ( not columns ) return summary;
+        assert(column < columns);
+        const std::size_t rows = fields.size() / columns;
+        std::size_t row{};
+        if ( meta.format_code == 1 ) {
+#if defined(__AVX2__)
+            using namespace aggregate_detail;
+            if ( oid != 21 && (std::is_integral<T>::value == (oid != 700 && oid != 701)) ) {
+                const std::size_t width = (oid == 20 || oid == 701) ? 8 : 4;
+                const auto words = reinterpret_cast<const long long *>(fields.data());
+                const auto zero = _mm256_setzero_si256(), one = _mm256_set1_epi64x(1);
+                const auto expected = _mm256_set1_epi64x(width);
+                auto index = row_indexes(column, columns);
+                const auto step = _mm256_set1_epi64x(8 * columns);
+                if constexpr ( std::is_integral<T>::value ) {
+                    auto sum = zero, count = zero;
+                    auto min = _mm256_set1_epi64x(summary.min), max = _mm256_set1_epi64x(summary.max);
+                    for ( ; row + 4 <= rows; row += 4 ) {
+                        const auto pointers = _mm256_i64gather_epi64(words, index, 8);
+                        const auto sizes = _mm256_i64gather_epi64(
+                            words, _mm256_add_epi64(index, one), 8);
+                        const auto nulls = _mm256_cmpeq_epi64(pointers, zero);
+                        const auto valid = _mm256_cmpeq_epi64(sizes, expected);
+                        if ( _mm256_movemask_epi8(_mm256_or_si256(nulls, valid)) != -1 ) break;
+                        const auto values = load_big_endian(pointers, valid, oid);
+                        sum = _mm256_add_epi64(sum, values);
+                        count = _mm256_sub_epi64(count, valid);
+                        min = _mm256_blendv_epi8(min, values,
+                            _mm256_and_si256(valid, _mm256_cmpgt_epi64(min, values)));
+                        max = _mm256_blendv_epi8(max, values,
+                            _mm256_and_si256(valid, _mm256_cmpgt_epi64(values, max)));
+                        index = _mm256_add_epi64(index, step);
+                    }
+                    alignas(32) int64_t lanes[4];
+                    summary.sum = horizontal_sum(sum);
+                    summary.count = horizontal_sum(count);
+                    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), min);
+                    for ( auto v : lanes ) summary.min = std::min<T>(summary.min, v);
+                    _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), max);
+                    for ( auto v : lanes ) summary.max = std::max<T>(summary.max, v);
+                } else {
+                    auto sum = _mm256_setzero_pd();
+                    auto count = zero;
+                    auto min = _mm256_set1_pd(summary.min), max = _mm256_set1_pd(summary.max);
+                    for ( ; row + 4 <= rows; row += 4 ) {
+                        const auto pointers = _mm256_i64gather_epi64(words, index, 8);
+                        const auto sizes = _mm256_i64gather_epi64(
+                            words, _mm256_add_epi64(index, one), 8);
+                        const auto nulls = _mm256_cmpeq_epi64(pointers, zero);
+                        const auto valid = _mm256_cmpeq_epi64(sizes, expected);
+                        if ( _mm256_movemask_epi8(_mm256_or_si256(nulls, valid)) != -1 ) break;
+                        const auto mask = _mm256_castsi256_pd(valid);
+                        const auto values = _mm256_castsi256_pd(load_big_endian(pointers, valid, oid));
+                        sum = _mm256_add_pd(sum, _mm256_and_pd(values, mask));
+                        count = _mm256_sub_epi64(count, valid);
+                        /// `NaN`s are left out of the minimum and maximum, in
+                        /// the same way as `std::min` and `std::max` do
+                        const auto ordered = _mm256_and_pd(mask,
+                            _mm256_cmp_pd(values, values, _CMP_ORD_Q));
+                        min = _mm256_blendv_pd(min, _mm256_min_pd(min, values), ordered);
+                        max = _mm256_blendv_pd(max, _mm256_max_pd(max, values), ordered);
+                        index = _mm256_add_epi64(index, step);
+                    }
+                    alignas(32) double lanes[4];
+                    _mm256_store_pd(lanes, sum);
+                    summary.sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+                    summary.count = horizontal_sum(count);
+                    _mm256_store_pd(lanes, min);
+                    for ( auto v : lanes ) summary.min = std::min(summary.min, v);
+                    _mm256_store_pd(lanes, max);
+                    for ( auto v : lanes ) summary.max = std::max(summary.max, v);
+                }
+            }
+#endif
+            for ( ; row < rows; ++row ) {
+                const auto field = fields[row * columns + column];
+                if ( field.data() ) summary(aggregate_detail::from_binary<T>(field, oid));
+            }
+        } else {
+            for ( ; row < rows; ++row ) {
+                const auto field = fields[row * columns + column];
+                if ( field.data() ) summary(aggregate_detail::from_text<T>(field));
+            }
+        }
+        return summary;
+    }
+
+
+    /// Summaries of every column of a recordset, built up a block at a time.
+    /// Summaries of different blocks can be built in parallel and then
+    /// merged using `+=`.
+    class recordset_summary {
+        std::vector<column_meta> m_columns;
+        std::vector<numeric_kind> kinds;
+
+    public:
+        /// The number of rows
+        std::size_t rows{};
+        /// The counts for each column
+        std::vector<field_summary> fields;
+        /// The numeric summaries for each column. Only the one matching the
+        /// column's `numeric_kind` is filled in.
+        std::vector<numeric_summary<int64_t>> integers;
+        std::vector<numeric_summary<double>> floats;
+
+        explicit recordset_summary(array_view<const column_meta> columns)
+        : m_columns(columns.begin(), columns.end()),
+            fields(columns.size()), integers(columns.size()), floats(columns.size())
+        {
+            for ( const auto &col : m_columns ) {
+                kinds.push_back(numeric_kind_for(col.field_type_oid));
+            }
+        }
+
+        /// The columns being summarised
+        array_view<const column_meta> columns() const {
+            return m_columns;
+        }
+        /// How each column is summarised
+        numeric_kind kind(std::size_t column) const {
+            return kinds[column];
+        }
+
+        /// Add the block to the summary
+        void operator () (const record_block &block) {
+            if ( not block.columns() ) return;
+            rows += block.fields().size() / block.columns();
+            for ( std::size_t column{}; column < kinds.size(); ++column ) {
+                fields[column] += summarise(block, column);
+                switch ( kinds[column] ) {
+                case numeric_kind::none:
+                    break;
+                case numeric_kind::integer:
+                    integers[column] += summarise_numeric<int64_t>(block, column, m_columns[column]);
+                    break;
+                case numeric_kind::floating:
+                    floats[column] += summarise_numeric<double>(block, column, m_columns[column]);
+                    break;
+                }
+            }
+        }
+
+        recordset_summary &operator += (const recordset_summary &s) {
+            rows += s.rows;
+            for ( std::size_t column{}; column < kinds.size(); ++column ) {
+                fields[column] += s.fields[column];
+                integers[column] += s.integers[column];
+                floats[column] += s.floats[column];
+            }
+            return *this;
+        }
+    };
+
+
+    /// Summarise the rest of the recordset, spreading the blocks over a
+    /// number of worker coroutines on the `io_service`, which should be run
+    /// by as many threads as there are cores. Each worker builds its own
+    /// summary and they're merged at the end. Any exception thrown by a
+    /// worker is re-thrown here once the recordset has been read.
+    template<typename S, typename Y> inline
+    recordset_summary summarise_recordset(
+        boost::asio::io_service &ios, recordset<S> &rs, std::size_t workers, Y yield,
+        std::size_t budget = 64u << 20
+    ) {
+        assert(workers > 0);
+        struct pipeline {
+            channel<record_block> blocks;
+            std::mutex mutex;
+            waiting finished;
+            recordset_summary total;
+            std::size_t running;
+            std::exception_ptr error;
+
+            pipeline(array_view<const column_meta> columns, std::size_t w, std::size_t b)
+            : blocks{b}, total{columns}, running{w} {
+            }
+        };
+        auto work = std::make_shared<pipeline>(rs.columns(), workers, budget);
+
+        for ( std::size_t w{}; w < workers; ++w ) {
+            boost::asio::spawn(ios, [work](auto yield) {
+                recordset_summary mine{work->total.columns()};
+                std::exception_ptr error;
+                while ( auto block = work->blocks.consume(yield) ) {
+                    try {
+                        if ( not error ) mine(*block);
+                    } catch ( ... ) {
+                        error = std::current_exception();
+                    }
+                }
+                std::unique_lock<std::mutex> lock{work->mutex};
+                work->total += mine;
+                if ( error && not work->error ) work->error = error;
+                if ( --work->running == 0 ) work->finished.notify_all();
+            });
+        }
+
+        std::exception_ptr error;
+        try {
+            while ( auto block = rs.next_block(yield) ) {
+                work->blocks.produce(std::move(block), yield);
+            }
+        } catch ( ... ) {
+            error = std::current_exception();
+        }
+        work->blocks.close();
+
+        std::unique_lock<std::mutex> lock{work->mutex};
+        while ( work->running ) work->finished.wait(lock, yield);
+        if ( error ) std::rethrow_exception(error);
+        if ( work->error ) std::rethrow_exception(work->error);
+        return std::move(work->total);
+    }
+
+
+}
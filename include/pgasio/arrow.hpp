@@ -0,0 +1,410 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/query.hpp>
+
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+
+/// The structures from the Arrow C data interface. These are a plain
+/// struct specification so no Arrow library is needed to produce them.
+/// https://arrow.apache.org/docs/format/CDataInterface.html
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif
+
+
+namespace pgasio {
+
+
+    /// The Arrow physical layouts that Postgres types are mapped on to
+    enum class arrow_type {
+        boolean, int16, int32, int64, uint32, float32, float64, utf8, binary
+    };
+
+
+    /// Return the Arrow layout used for a Postgres type OID and the format
+    /// (0 for text, 1 for binary) its values arrive in. Anything that isn't
+    /// known to have a fixed width representation is delivered as UTF-8
+    /// when it is in the text format and as binary when it is in the
+    /// binary format. `bytea` is always delivered as binary.
+    inline arrow_type arrow_type_for(int32_t oid, int16_t format) {
+        switch ( oid ) {
+        case 16: return arrow_type::boolean; // bool
+        case 17: return arrow_type::binary; // bytea
+        case 20: return arrow_type::int64; // int8
+        case 21: return arrow_type::int16; // int2
+        case 23: return arrow_type::int32; // int4
+        case 26: return arrow_type::uint32; // oid
+        case 700: return arrow_type::float32; // float4
+        case 701: return arrow_type::float64; // float8
+        default: return format == 1 ? arrow_type::binary : arrow_type::utf8;
+        }
+    }
+
+    /// The Arrow C data interface format string for the layout
+    inline const char *arrow_format(arrow_type t) {
+        switch ( t ) {
+        case arrow_type::boolean: return "b";
+        case arrow_type::int16: return "s";
+        case arrow_type::int32: return "i";
+        case arrow_type::int64: return "l";
+        case arrow_type::uint32: return "I";
+        case arrow_type::float32: return "f";
+        case arrow_type::float64: return "g";
+        case arrow_type::binary: return "z";
+        case arrow_type::utf8: break;
+        }
+        return "u";
+    }
+
+
+    /// The columnar buffers for a single column. Fixed width values are
+    /// stored in native byte order, variable width values use 32 bit
+    /// offsets into the value buffer.
+    class arrow_column {
+        std::vector<unsigned char> m_validity, m_values;
+        std::vector<int32_t> m_offsets;
+        std::size_t m_length, m_nulls;
+
+        /// Set (or clear) the bit for the current row in a bitmap
+        static void set_bit(std::vector<unsigned char> &bits, std::size_t index, bool value) {
+            if ( index / 8 >= bits.size() ) bits.push_back(0u);
+            if ( value ) bits[index / 8] |= (1u << (index % 8));
+        }
+
+        template<typename V>
+        void store(V v) {
+            const auto at = m_values.size();
+            m_values.resize(at + sizeof(V));
+            std::memcpy(m_values.data() + at, &v, sizeof(V));
+        }
+        template<typename U>
+        static U big_endian(byte_view field) {
+            if ( field.size() != sizeof(U) ) {
+                throw std::runtime_error("Binary field has the wrong size for its type");
+            }
+            U u{};
+            for ( auto b : field ) u = (u << 8) | b;
+            return u;
+        }
+        template<typename V>
+        static V from_text(byte_view field) {
+            V v{};
+            const auto begin = reinterpret_cast<const char *>(field.data());
+            const auto [ptr, ec] = std::from_chars(begin, begin + field.size(), v);
+            if ( ec != std::errc{} || ptr != begin + field.size() ) {
+                throw std::runtime_error("Could not parse the numeric field text: " +
+                    std::string(begin, begin + field.size()));
+            }
+            return v;
+        }
+        template<typename V, typename U>
+        void fixed(byte_view field, int16_t format) {
+            if ( format == 1 ) {
+                const auto bits = big_endian<U>(field);
+                V v;
+                std::memcpy(&v, &bits, sizeof(V));
+                store(v);
+            } else {
+                store(from_text<V>(field));
+            }
+        }
+        /// Decode the text format of a `bytea`, which is either hex (`\x`
+        /// followed by two hex digits per byte) or the older escape format
+        void unescape_bytea(byte_view field) {
+            auto digit = [](unsigned char c) -> unsigned {
+                if ( c >= '0' && c <= '9' ) return c - '0';
+                if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+                if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+                throw std::runtime_error("Invalid hex digit in bytea text");
+            };
+            const auto end = field.end();
+            if ( field.size() >= 2 && field[0] == '\\' && field[1] == 'x' ) {
+                if ( field.size() % 2 ) throw std::runtime_error("Truncated hex bytea text");
+                for ( auto at = field.begin() + 2; at != end; at += 2 ) {
+                    m_values.push_back((digit(at[0]) << 4) | digit(at[1]));
+                }
+            } else {
+                for ( auto at = field.begin(); at != end; ) {
+                    if ( *at != '\\' ) {
+                        m_values.push_back(*at++);
+                    } else if ( end - at >= 2 && at[1] == '\\' ) {
+                        m_values.push_back('\\');
+                        at += 2;
+                    } else if ( end - at >= 4 ) {
+                        m_values.push_back(((at[1] - '0') << 6) | ((at[2] - '0') << 3) | (at[3] - '0'));
+                        at += 4;
+                    } else {
+                        throw std::runtime_error("Invalid escape in bytea text");
+                    }
+                }
+            }
+        }
+        void zero() {
+            switch ( type ) {
+            case arrow_type::boolean: break;
+            case arrow_type::int16: store(int16_t{}); break;
+            case arrow_type::int32: store(int32_t{}); break;
+            case arrow_type::uint32: store(uint32_t{}); break;
+            case arrow_type::int64: store(int64_t{}); break;
+            case arrow_type::float32: store(float{}); break;
+            case arrow_type::float64: store(double{}); break;
+            case arrow_type::utf8:
+            case arrow_type::binary:
+                m_offsets.push_back(m_values.size());
+            }
+        }
+
+    public:
+        /// The Arrow layout for this column
+        const arrow_type type;
+        /// The column name
+        const std::string name;
+
+        arrow_column(const column_meta &meta)
+        : m_offsets{0}, m_length{}, m_nulls{},
+            type{arrow_type_for(meta.field_type_oid, meta.format_code)}, name{meta.name} {
+        }
+
+        /// Append a field value. A `nullptr` data pointer is a NULL.
+        void append(byte_view field, int16_t format) {
+            if ( field.data() == nullptr ) {
+                set_bit(m_validity, m_length, false);
+                if ( type == arrow_type::boolean ) set_bit(m_values, m_length, false);
+                zero();
+                ++m_nulls;
+            } else {
+                set_bit(m_validity, m_length, true);
+                switch ( type ) {
+                case arrow_type::boolean:
+                    if ( field.size() != 1 ) {
+                        throw std::runtime_error("Boolean field is the wrong size");
+                    }
+                    set_bit(m_values, m_length, format == 1 ? field[0] != 0 : field[0] == 't');
+                    break;
+                case arrow_type::int16: fixed<int16_t, uint16_t>(field, format); break;
+                case arrow_type::int32: fixed<int32_t, uint32_t>(field, format); break;
+                case arrow_type::uint32: fixed<uint32_t, uint32_t>(field, format); break;
+                case arrow_type::int64: fixed<int64_t, uint64_t>(field, format); break;
+                case arrow_type::float32: fixed<float, uint32_t>(field, format); break;
+                case arrow_type::float64: fixed<double, uint64_t>(field, format); break;
+                case arrow_type::utf8:
+                case arrow_type::binary:
+                    /// The only binary column that can be in the text
+                    /// format is a `bytea`
+                    if ( type == arrow_type::binary && format == 0 ) {
+                        unescape_bytea(field);
+                    } else {
+                        m_values.insert(m_values.end(), field.begin(), field.end());
+                    }
+                    if ( m_values.size() > std::size_t(std::numeric_limits<int32_t>::max()) ) {
+                        throw std::runtime_error("Arrow column has more than 2GB of data");
+                    }
+                    m_offsets.push_back(m_values.size());
+                }
+            }
+            ++m_length;
+        }
+
+        /// The number of values in the column
+        std::size_t length() const {
+            return m_length;
+        }
+        /// The number of NULLs in the column
+        std::size_t null_count() const {
+            return m_nulls;
+        }
+
+        /// The validity bitmap. Bit `n` (least significant bit first) is set
+        /// if row `n` is not NULL
+        byte_view validity() const {
+            return m_validity;
+        }
+        /// The offsets buffer. This is only used for variable width columns
+        array_view<const int32_t> offsets() const {
+            return m_offsets;
+        }
+        /// The value buffer
+        byte_view values() const {
+            return m_values;
+        }
+
+        /// Return the buffers in the order the Arrow C data interface expects
+        /// them to be in. Returns the number of buffers used.
+        std::size_t buffers(std::array<const void *, 3> &into) const {
+            into[0] = m_nulls ? m_validity.data() : nullptr;
+            if ( type == arrow_type::utf8 || type == arrow_type::binary ) {
+                into[1] = m_offsets.data();
+                into[2] = m_values.data();
+                return 3;
+            } else {
+                into[1] = m_values.data();
+                return 2;
+            }
+        }
+    };
+
+
+    /// A record batch holding the data for a recordset in the Arrow columnar
+    /// layout. Blocks are appended as they're fetched and the batch can then
+    /// be handed over through the Arrow C data interface.
+    class arrow_batch {
+        std::vector<arrow_column> m_columns;
+        std::vector<int16_t> formats;
+        std::size_t m_rows;
+
+    public:
+        /// Create an empty batch for the columns
+        arrow_batch(array_view<const column_meta> columns)
+        : m_rows{} {
+            m_columns.reserve(columns.size());
+            for ( const auto &col : columns ) {
+                m_columns.emplace_back(col);
+                formats.push_back(col.format_code);
+            }
+        }
+
+        /// The columns in the batch
+        array_view<const arrow_column> columns() const {
+            return m_columns;
+        }
+        /// The number of rows in the batch
+        std::size_t rows() const {
+            return m_rows;
+        }
+
+        /// Pivot the rows in the block into the columns
+        void append(const record_block &block) {
+            if ( m_columns.empty() ) return;
+            for ( std::size_t col{}; col < m_columns.size(); ++col ) {
+                auto &column = m_columns[col];
+                const auto format = formats[col];
+                for ( auto fields = block.fields().slice(col); fields.size();
+                    fields = fields.slice(std::min(m_columns.size(), fields.size())) )
+                {
+                    column.append(fields[0], format);
+                }
+            }
+            m_rows = m_columns[0].length();
+        }
+
+        /// Move the batch into the Arrow C data interface structures. The
+        /// batch is a struct array with one child per column. The consumer
+        /// must call the `release` members when it is done with them.
+        void export_to(ArrowSchema *schema, ArrowArray *array) && {
+            struct exported {
+                std::vector<arrow_column> columns;
+                std::vector<std::array<const void *, 3>> buffers;
+                std::vector<ArrowSchema> child_schemas;
+                std::vector<ArrowSchema *> schema_pointers;
+                std::vector<ArrowArray> child_arrays;
+                std::vector<ArrowArray *> array_pointers;
+                /// Every structure handed out holds a reference to the data
+                /// so that children can be moved away from their parent
+                std::size_t live = 0;
+
+                static void release(exported *d) {
+                    if ( --d->live == 0 ) delete d;
+                }
+            };
+            auto data = std::make_unique<exported>();
+            data->columns = std::move(m_columns);
+            const auto count = data->columns.size();
+            data->live = 2 * (count + 1);
+            data->buffers.resize(count);
+            data->child_schemas.resize(count);
+            data->child_arrays.resize(count);
+            auto release_schema = [](ArrowSchema *s) {
+                for ( int64_t c{}; c < s->n_children; ++c ) {
+                    if ( s->children[c]->release ) s->children[c]->release(s->children[c]);
+                }
+                s->release = nullptr;
+                exported::release(static_cast<exported *>(s->private_data));
+            };
+            auto release_array = [](ArrowArray *a) {
+                for ( int64_t c{}; c < a->n_children; ++c ) {
+                    if ( a->children[c]->release ) a->children[c]->release(a->children[c]);
+                }
+                a->release = nullptr;
+                exported::release(static_cast<exported *>(a->private_data));
+            };
+            for ( std::size_t c{}; c < count; ++c ) {
+                const auto &column = data->columns[c];
+                data->child_schemas[c] = ArrowSchema{
+                    arrow_format(column.type), column.name.c_str(), nullptr,
+                    ARROW_FLAG_NULLABLE, 0, nullptr, nullptr,
+                    release_schema, data.get()};
+                data->schema_pointers.push_back(&data->child_schemas[c]);
+                const auto buffers = column.buffers(data->buffers[c]);
+                data->child_arrays[c] = ArrowArray{
+                    int64_t(column.length()), int64_t(column.null_count()), 0,
+                    int64_t(buffers), 0, data->buffers[c].data(), nullptr, nullptr,
+                    release_array, data.get()};
+                data->array_pointers.push_back(&data->child_arrays[c]);
+            }
+            static const void *no_validity[] = {nullptr};
+            *schema = ArrowSchema{
+                "+s", "", nullptr, 0, int64_t(count),
+                data->schema_pointers.data(), nullptr,
+                release_schema, data.get()};
+            *array = ArrowArray{
+                int64_t(m_rows), 0, 0, 1, int64_t(count),
+                no_validity, data->array_pointers.data(), nullptr,
+                release_array, data.get()};
+            data.release();
+            m_rows = 0;
+        }
+    };
+
+
+    /// Fetch the rest of the recordset's blocks into a single Arrow batch
+    template<typename S, typename Y> inline
+    arrow_batch arrow_record_batch(recordset<S> &rs, Y yield) {
+        arrow_batch batch{rs.columns()};
+        while ( auto block = rs.next_block(yield) ) {
+            batch.append(block);
+        }
+        return batch;
+    }
+
+
+}
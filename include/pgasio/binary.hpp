@@ -0,0 +1,410 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/query.hpp>
+
+#include <boost/endian/conversion.hpp>
+
+#include <string>
+#include <string_view>
+
+
+namespace pgasio {
+
+
+    /// The Postgres types that C++ types are encoded as in the binary format
+    template<typename T>
+    struct binary_type;
+    template<> struct binary_type<bool> {
+        static constexpr int32_t oid = 16, array_oid = 1000;
+    };
+    template<> struct binary_type<int16_t> {
+        static constexpr int32_t oid = 21, array_oid = 1005;
+    };
+    template<> struct binary_type<int32_t> {
+        static constexpr int32_t oid = 23, array_oid = 1007;
+    };
+    template<> struct binary_type<int64_t> {
+        static constexpr int32_t oid = 20, array_oid = 1016;
+    };
+    template<> struct binary_type<float> {
+        static constexpr int32_t oid = 700, array_oid = 1021;
+    };
+    template<> struct binary_type<double> {
+        static constexpr int32_t oid = 701, array_oid = 1022;
+    };
+    template<> struct binary_type<std::string_view> {
+        static constexpr int32_t oid = 25, array_oid = 1009;
+    };
+    template<> struct binary_type<std::string> : binary_type<std::string_view> {};
+    template<> struct binary_type<byte_view> {
+        static constexpr int32_t oid = 17, array_oid = 1001;
+    };
+
+
+    /// The element type of an array type, or zero if the type isn't an
+    /// array type that is known about
+    inline int32_t array_element_oid(int32_t array_oid) {
+        switch ( array_oid ) {
+        case 1000: return 16; // bool
+        case 1001: return 17; // bytea
+        case 1005: return 21; // int2
+        case 1007: return 23; // int4
+        case 1009: return 25; // text
+        case 1015: return 1043; // varchar
+        case 1016: return 20; // int8
+        case 1021: return 700; // float4
+        case 1022: return 701; // float8
+        case 1028: return 26; // oid
+        case 1115: return 1114; // timestamp
+        case 1185: return 1184; // timestamptz
+        case 1231: return 1700; // numeric
+        case 2951: return 2950; // uuid
+        case 3807: return 3802; // jsonb
+        default: return 0;
+        }
+    }
+    /// True if the column holds arrays in the binary format
+    inline bool binary_array_column(const column_meta &col) {
+        return col.format_code == 1 && array_element_oid(col.field_type_oid) != 0;
+    }
+
+
+    /// Append the binary format of the value
+    template<typename T>
+    void append_binary(std::vector<unsigned char> &out, T value) {
+        static_assert(std::is_arithmetic<T>::value, "Use a byte_view or string for other types");
+        if constexpr ( std::is_same<T, bool>::value ) {
+            out.push_back(value ? 1 : 0);
+        } else {
+            std::conditional_t<sizeof(T) == 8, uint64_t,
+                std::conditional_t<sizeof(T) == 4, uint32_t, uint16_t>> bits;
+            static_assert(sizeof(bits) == sizeof(T), "Unsupported size of value");
+            std::memcpy(&bits, &value, sizeof(T));
+            bits = boost::endian::native_to_big(bits);
+            const auto bytes = reinterpret_cast<const unsigned char *>(&bits);
+            out.insert(out.end(), bytes, bytes + sizeof(T));
+        }
+    }
+    inline void append_binary(std::vector<unsigned char> &out, byte_view value) {
+        out.insert(out.end(), value.begin(), value.end());
+    }
+    inline void append_binary(std::vector<unsigned char> &out, std::string_view value) {
+        out.insert(out.end(), value.begin(), value.end());
+    }
+
+
+    /// Read a value in the binary format. The field must not be `NULL`.
+    template<typename T>
+    T binary_value(byte_view field) {
+        if constexpr ( std::is_same<T, std::string>::value ||
+                std::is_same<T, std::string_view>::value )
+        {
+            return T(reinterpret_cast<const char *>(field.data()), field.size());
+        } else if constexpr ( std::is_same<T, byte_view>::value ) {
+            return field;
+        } else {
+            static_assert(std::is_arithmetic<T>::value, "Can't read this type");
+            if ( field.size() != sizeof(T) ) {
+                throw std::runtime_error("Binary value has the wrong size for its type");
+            }
+            if constexpr ( std::is_same<T, bool>::value ) {
+                return field[0] != 0;
+            } else {
+                std::conditional_t<sizeof(T) == 8, uint64_t,
+                    std::conditional_t<sizeof(T) == 4, uint32_t, uint16_t>> bits;
+                std::memcpy(&bits, field.data(), sizeof(T));
+                bits = boost::endian::big_to_native(bits);
+                T value;
+                std::memcpy(&value, &bits, sizeof(T));
+                return value;
+            }
+        }
+    }
+
+
+    /// The size and lower bound (normally 1) of one array dimension
+    struct array_dimension {
+        int32_t size;
+        int32_t lower_bound;
+    };
+
+
+    /// Builds an array in the binary format, for use as a query parameter
+    /// or as a field of a composite. Elements are added in row major order.
+    /// The array is one dimensional unless the dimensions are given.
+    ///
+    ///     pgasio::array_builder keys{pgasio::binary_type<int64_t>::oid};
+    ///     for ( auto k : wanted ) keys(k);
+    ///     pgasio::byte_view parameter = keys.finish();
+    class array_builder {
+        std::vector<unsigned char> buffer;
+        std::vector<array_dimension> dimensions;
+        const int32_t element_oid;
+        std::size_t count;
+        bool nulls;
+
+        static std::size_t header_size(std::size_t dimensions) {
+            return 12u + 8u * dimensions;
+        }
+        void store(std::size_t at, int32_t value) {
+            const auto be = boost::endian::native_to_big(value);
+            std::memcpy(buffer.data() + at, &be, 4);
+        }
+        void length(int32_t bytes) {
+            buffer.resize(buffer.size() + 4);
+            store(buffer.size() - 4, bytes);
+        }
+
+    public:
+        /// Start an array of elements of the type. The bytes are reserved
+        /// up front to save re-allocating a large array
+        explicit array_builder(
+            int32_t oid, std::vector<array_dimension> dims = {},
+            std::size_t reserve = 0u
+        ) : dimensions(std::move(dims)), element_oid{oid}, count{}, nulls{false} {
+            buffer.reserve(std::max(reserve, header_size(dimensions.size() ? dimensions.size() : 1u)));
+            buffer.resize(header_size(dimensions.size() ? dimensions.size() : 1u));
+        }
+
+        /// The number of elements added so far
+        std::size_t size() const {
+            return count;
+        }
+
+        /// Add a `NULL` element
+        array_builder &null() {
+            length(-1);
+            nulls = true;
+            ++count;
+            return *this;
+        }
+        /// Add an element that is already in the binary format of the
+        /// element type, e.g. a composite from a `record_builder`
+        array_builder &raw(byte_view element) {
+            length(element.size());
+            append_binary(buffer, element);
+            ++count;
+            return *this;
+        }
+        /// Add an element
+        template<typename T>
+        array_builder &operator () (const T &value) {
+            if constexpr ( std::is_arithmetic<T>::value ) {
+                length(std::is_same<T, bool>::value ? 1 : sizeof(T));
+                append_binary(buffer, value);
+                ++count;
+                return *this;
+            } else {
+                return raw(byte_view{
+                    reinterpret_cast<const unsigned char *>(std::data(value)), std::size(value)});
+            }
+        }
+
+        /// Fill in the array header and return the encoded array. The
+        /// memory belongs to the builder.
+        byte_view finish() {
+            if ( dimensions.empty() ) {
+                if ( count ) {
+                    store(12, count);
+                    store(16, 1);
+                    store(0, 1);
+                } else {
+                    /// An empty array has no dimensions at all
+                    buffer.resize(header_size(0));
+                    store(0, 0);
+                }
+            } else {
+                std::size_t expected = 1;
+                for ( std::size_t d{}; d < dimensions.size(); ++d ) {
+                    expected *= dimensions[d].size;
+                    store(12 + 8 * d, dimensions[d].size);
+                    store(16 + 8 * d, dimensions[d].lower_bound);
+                }
+                if ( expected != count ) {
+                    throw std::logic_error("Array has the wrong number of elements for its dimensions");
+                }
+                store(0, dimensions.size());
+            }
+            store(4, nulls ? 1 : 0);
+            store(8, element_oid);
+            return byte_view{buffer};
+        }
+    };
+
+
+    /// Decodes an array in the binary format. The elements point into the
+    /// field's memory, which must stay valid.
+    class array_reader {
+        std::vector<array_dimension> m_dimensions;
+        std::vector<byte_view> elements;
+        int32_t m_element_oid;
+        bool m_nulls;
+
+    public:
+        explicit array_reader(byte_view field) {
+            decoder array{field};
+            const auto dimensions = array.read_int32();
+            if ( dimensions < 0 || dimensions > 6 ) {
+                throw std::runtime_error("Binary array has an invalid number of dimensions");
+            }
+            m_nulls = array.read_int32() != 0;
+            m_element_oid = array.read_int32();
+            std::size_t total = dimensions ? 1u : 0u;
+            for ( int32_t d{}; d < dimensions; ++d ) {
+                const auto size = array.read_int32();
+                const auto lower = array.read_int32();
+                if ( size < 0 ) throw std::runtime_error("Binary array has a negative dimension");
+                m_dimensions.push_back({size, lower});
+                total *= size;
+            }
+            /// Each element takes at least four bytes
+            if ( total > array.remaining() / 4 ) {
+                throw std::runtime_error("Binary array is shorter than its dimensions");
+            }
+            elements.reserve(total);
+            while ( elements.size() != total ) {
+                const auto bytes = array.read_int32();
+                if ( bytes < 0 ) {
+                    elements.push_back(byte_view{});
+                } else {
+                    elements.push_back(array.read_bytes(bytes));
+                }
+            }
+            if ( array.remaining() ) {
+                throw std::runtime_error("Binary array has bytes after its elements");
+            }
+        }
+
+        /// The type of the elements
+        int32_t element_oid() const {
+            return m_element_oid;
+        }
+        /// The dimensions of the array. An empty array has none
+        array_view<const array_dimension> dimensions() const {
+            return m_dimensions;
+        }
+        /// True if Postgres says there may be `NULL` elements
+        bool has_nulls() const {
+            return m_nulls;
+        }
+
+        /// The number of elements across all dimensions
+        std::size_t size() const {
+            return elements.size();
+        }
+        /// The binary data for an element. A `NULL` has a null `data()`
+        byte_view operator [] (std::size_t index) const {
+            return elements[index];
+        }
+        auto begin() const {
+            return elements.begin();
+        }
+        auto end() const {
+            return elements.end();
+        }
+    };
+
+
+    /// Builds a composite (row) value in the binary format, e.g. for a
+    /// parameter of a composite type or for the elements of an array of
+    /// them. Each field carries its own type.
+    class record_builder {
+        std::vector<unsigned char> buffer;
+        int32_t fields;
+
+        void field(int32_t oid, int32_t bytes) {
+            append_binary(buffer, oid);
+            append_binary(buffer, bytes);
+            ++fields;
+        }
+
+    public:
+        record_builder()
+        : buffer(4u), fields{} {
+        }
+
+        /// Add a `NULL` field of the type
+        record_builder &null(int32_t oid) {
+            field(oid, -1);
+            return *this;
+        }
+        /// Add a field of the type that is already in its binary format
+        record_builder &raw(int32_t oid, byte_view value) {
+            field(oid, value.size());
+            append_binary(buffer, value);
+            return *this;
+        }
+        /// Add a field
+        template<typename T>
+        record_builder &operator () (const T &value) {
+            if constexpr ( std::is_arithmetic<T>::value ) {
+                field(binary_type<T>::oid, std::is_same<T, bool>::value ? 1 : sizeof(T));
+                append_binary(buffer, value);
+                return *this;
+            } else {
+                return raw(binary_type<T>::oid, byte_view{
+                    reinterpret_cast<const unsigned char *>(std::data(value)), std::size(value)});
+            }
+        }
+
+        /// Fill in the field count and return the encoded value. The memory
+        /// belongs to the builder.
+        byte_view finish() {
+            const auto be = boost::endian::native_to_big(fields);
+            std::memcpy(buffer.data(), &be, 4);
+            return byte_view{buffer};
+        }
+    };
+
+
+    /// A field of a composite value
+    struct record_field {
+        int32_t oid;
+        /// A `NULL` has a null `data()`
+        byte_view value;
+    };
+
+
+    /// Decodes a composite (row) value in the binary format. The fields
+    /// point into the value's memory, which must stay valid.
+    class record_reader {
+        std::vector<record_field> m_fields;
+
+    public:
+        explicit record_reader(byte_view value) {
+            decoder record{value};
+            const auto count = record.read_int32();
+            if ( count < 0 || std::size_t(count) > record.remaining() / 8 ) {
+                throw std::runtime_error("Binary composite has an invalid field count");
+            }
+            m_fields.reserve(count);
+            while ( m_fields.size() != std::size_t(count) ) {
+                const auto oid = record.read_int32();
+                const auto bytes = record.read_int32();
+                m_fields.push_back({oid, bytes < 0 ? byte_view{} : record.read_bytes(bytes)});
+            }
+            if ( record.remaining() ) {
+                throw std::runtime_error("Binary composite has bytes after its fields");
+            }
+        }
+
+        /// The fields in the order they're declared in the type
+        array_view<const record_field> fields() const {
+            return m_fields;
+        }
+        std::size_t size() const {
+            return m_fields.size();
+        }
+        const record_field &operator [] (std::size_t index) const {
+            return m_fields[index];
+        }
+    };
+
+
+}
@@ -60,6 +60,12 @@ namespace pgasio {
             }
         }
 
+        /// The number of bytes that have been read from the socket but not
+        /// yet transferred
+        std::size_t buffered() const {
+            return filled.size();
+        }
+
         /// Pass on methods to socket
         auto is_open() { return socket.is_open(); }
 
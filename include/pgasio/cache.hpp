@@ -0,0 +1,348 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/channel.hpp>
+#include <pgasio/query.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <unordered_map>
+
+
+namespace pgasio {
+
+
+    /// The rows of a query held in a `result_cache`. These are never
+    /// changed once they are cached, so they can be shared by any number of
+    /// readers on any threads.
+    struct cached_result {
+        /// The columns of the last recordset the query returned
+        std::vector<column_meta> columns;
+        /// The rows of that recordset
+        std::vector<record_block> blocks;
+    };
+
+
+    /// Return the SQL for a trigger that sends a notification on the channel
+    /// whenever the table is changed. The payload is the table name. The
+    /// table name is used as it is given, so it may be schema qualified and
+    /// quoted if it needs to be.
+    ///
+    /// The trigger and its function are named after the channel. The name
+    /// ends with a 64 bit hash of the whole channel name so that channels
+    /// that only differ in punctuation, case or after the first few
+    /// characters still get their own function.
+    inline std::string notify_trigger_sql(const std::string &table, const std::string &channel) {
+        std::string literal = "'";
+        for ( const char c : channel ) {
+            if ( c == '\'' ) literal += '\'';
+            literal += c;
+        }
+        literal += '\'';
+        /// FNV-1a
+        uint64_t hash = 14695981039346656037u;
+        for ( const char c : channel ) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211u;
+        }
+        /// Postgres truncates names to 63 bytes, so only the start of the
+        /// channel is kept to make the name readable
+        std::string function = "\"pgasio_notify_";
+        for ( std::size_t i{}; i < channel.size() && i < 24; ++i ) {
+            const char c = channel[i];
+            function += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+        }
+        function += '_';
+        for ( int shift = 60; shift >= 0; shift -= 4 ) {
+            function += "0123456789abcdef"[(hash >> shift) & 0xf];
+        }
+        function += '"';
+        return "CREATE OR REPLACE FUNCTION " + function + "() RETURNS trigger AS $$ "
+                "BEGIN PERFORM pg_notify(" + literal + ", TG_TABLE_NAME); RETURN NULL; END "
+            "$$ LANGUAGE plpgsql; "
+            "DROP TRIGGER IF EXISTS " + function + " ON " + table + "; "
+            "CREATE TRIGGER " + function + " AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE "
+                "ON " + table + " FOR EACH STATEMENT EXECUTE PROCEDURE " + function + "()";
+    }
+
+
+    /// A cache of query results, keyed by the SQL and its parameters. It is
+    /// meant for repeated reads of data that changes rarely, e.g. reference
+    /// tables.
+    ///
+    /// Each result is kept until its time to live runs out or one of the
+    /// notification channels it depends on is notified. The notifications
+    /// are received by `listen`, which needs its own connection. Results
+    /// are only cached once every channel they depend on is being listened
+    /// to, so a result is never kept when the change that should remove it
+    /// could be missed. Results that don't depend on any channels are
+    /// cached for the time to live.
+    ///
+    /// When several coroutines ask for the same result that isn't cached
+    /// only one of them runs the query and the others wait for it. The
+    /// cache can be used from coroutines on any thread.
+    class result_cache {
+        struct entry {
+            std::shared_ptr<const cached_result> result;
+            std::chrono::steady_clock::time_point expires;
+            std::vector<std::string> channels;
+        };
+        /// A query that is being run on behalf of everybody who wants it
+        struct loading {
+            bool done = false;
+            std::shared_ptr<const cached_result> result;
+            std::exception_ptr error;
+            waiting finished;
+        };
+
+        std::chrono::steady_clock::duration m_ttl;
+        std::mutex mutex;
+        std::unordered_map<std::string, entry> entries;
+        std::unordered_map<std::string, std::shared_ptr<loading>> loads;
+        /// The channels being listened to, and the number of notifications
+        /// seen on each, so a load can tell if it raced with a change
+        std::unordered_map<std::string, std::size_t> listening;
+        std::size_t m_hits{}, m_misses{};
+
+        static std::string key(const std::string &sql, array_view<const byte_view> parameters) {
+            std::string k = sql;
+            for ( const auto p : parameters ) {
+                k += '\0';
+                if ( p.data() ) {
+                    k += std::to_string(p.size()) + ':';
+                    k.append(reinterpret_cast<const char *>(p.data()), p.size());
+                } else {
+                    k += '-';
+                }
+            }
+            return k;
+        }
+
+        /// Called with the lock held
+        void erase_channel(const std::string &channel) {
+            for ( auto e = entries.begin(); e != entries.end(); ) {
+                const auto &chans = e->second.channels;
+                if ( std::find(chans.begin(), chans.end(), channel) != chans.end() ) {
+                    e = entries.erase(e);
+                } else {
+                    ++e;
+                }
+            }
+        }
+
+        template<typename S, typename Y>
+        static std::shared_ptr<const cached_result> fetch(
+            connection<S> &cnx, const std::string &sql,
+            array_view<const byte_view> parameters, Y yield
+        ) {
+            /// The blocks outlive the query, so they mustn't come out of a
+            /// per-request memory resource that the connection may be using
+            struct restore {
+                connection<S> &cnx;
+                std::pmr::memory_resource *memory;
+                ~restore() { cnx.memory = memory; }
+            } put_back{cnx, cnx.memory};
+            cnx.memory = std::pmr::new_delete_resource();
+
+            auto loaded = std::make_shared<cached_result>();
+            auto results = parameters.size()
+                ? pgasio::query(cnx, sql, parameters, yield) : pgasio::query(cnx, sql, yield);
+            while ( auto rs = results.recordset(yield) ) {
+                loaded->columns.assign(rs.columns().begin(), rs.columns().end());
+                loaded->blocks.clear();
+                while ( auto block = rs.next_block(yield) ) {
+                    loaded->blocks.push_back(std::move(block));
+                }
+            }
+            return loaded;
+        }
+
+    public:
+        explicit result_cache(std::chrono::steady_clock::duration t = std::chrono::minutes{5})
+        : m_ttl{t} {
+        }
+
+        /// Not copyable
+        result_cache(const result_cache &) = delete;
+        result_cache &operator = (const result_cache &) = delete;
+
+        /// The time to live for new results
+        std::chrono::steady_clock::duration ttl() const {
+            return m_ttl;
+        }
+
+        /// The number of results cached
+        std::size_t size() {
+            std::unique_lock<std::mutex> lock{mutex};
+            return entries.size();
+        }
+        /// The number of times a cached result was used
+        std::size_t hits() {
+            std::unique_lock<std::mutex> lock{mutex};
+            return m_hits;
+        }
+        /// The number of times the query had to be run
+        std::size_t misses() {
+            std::unique_lock<std::mutex> lock{mutex};
+            return m_misses;
+        }
+
+        /// Return the results of the query, running it on the connection if
+        /// they aren't cached. `channels` are the notification channels for
+        /// the tables the query reads. Any exception from running the query
+        /// is thrown to everybody waiting for it, and nothing is cached.
+        template<typename S, typename Y>
+        std::shared_ptr<const cached_result> query(
+            connection<S> &cnx, const std::string &sql,
+            array_view<const byte_view> parameters,
+            std::vector<std::string> channels, Y yield
+        ) {
+            const auto k = key(sql, parameters);
+            std::unique_lock<std::mutex> lock{mutex};
+            const auto found = entries.find(k);
+            if ( found != entries.end() ) {
+                if ( found->second.expires > std::chrono::steady_clock::now() ) {
+                    ++m_hits;
+                    return found->second.result;
+                }
+                entries.erase(found);
+            }
+            if ( auto running = loads.find(k); running != loads.end() ) {
+                auto load = running->second;
+                while ( not load->done ) load->finished.wait(lock, yield);
+                if ( load->error ) std::rethrow_exception(load->error);
+                return load->result;
+            }
+
+            ++m_misses;
+            auto load = std::make_shared<loading>();
+            loads.emplace(k, load);
+            /// If any of these change whilst the query is running then the
+            /// result can't be cached
+            std::vector<std::pair<std::string, std::size_t>> seen;
+            bool cacheable = true;
+            for ( const auto &channel : channels ) {
+                const auto listened = listening.find(channel);
+                if ( listened == listening.end() ) {
+                    cacheable = false;
+                } else {
+                    seen.emplace_back(channel, listened->second);
+                }
+            }
+            lock.unlock();
+
+            std::exception_ptr error;
+            try {
+                load->result = fetch(cnx, sql, parameters, yield);
+            } catch ( ... ) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            for ( const auto &s : seen ) {
+                const auto listened = listening.find(s.first);
+                if ( listened == listening.end() || listened->second != s.second ) {
+                    cacheable = false;
+                }
+            }
+            if ( cacheable && not error ) {
+                entries[k] = entry{load->result,
+                    std::chrono::steady_clock::now() + m_ttl, std::move(channels)};
+            }
+            loads.erase(k);
+            load->error = error;
+            load->done = true;
+            load->finished.notify_all();
+            if ( error ) std::rethrow_exception(error);
+            return load->result;
+        }
+        template<typename S, typename Y>
+        std::shared_ptr<const cached_result> query(
+            connection<S> &cnx, const std::string &sql,
+            std::vector<std::string> channels, Y yield
+        ) {
+            return query(cnx, sql, array_view<const byte_view>{}, std::move(channels), yield);
+        }
+
+        /// Remove the results that depend on the channel
+        void invalidate(const std::string &channel) {
+            std::unique_lock<std::mutex> lock{mutex};
+            if ( auto listened = listening.find(channel); listened != listening.end() ) {
+                ++listened->second;
+            }
+            erase_channel(channel);
+        }
+        /// Remove everything
+        void clear() {
+            std::unique_lock<std::mutex> lock{mutex};
+            for ( auto &listened : listening ) ++listened.second;
+            entries.clear();
+        }
+        /// Remove the results whose time to live has run out
+        void purge() {
+            std::unique_lock<std::mutex> lock{mutex};
+            const auto now = std::chrono::steady_clock::now();
+            for ( auto e = entries.begin(); e != entries.end(); ) {
+                if ( e->second.expires <= now ) {
+                    e = entries.erase(e);
+                } else {
+                    ++e;
+                }
+            }
+        }
+
+        /// Listen for notifications on the channels, invalidating the
+        /// results that depend on them as they arrive. The connection must
+        /// only be used for this. It returns when the connection is closed,
+        /// throwing the error that closed it. Because notifications might
+        /// have been missed the cache is then cleared, and results that
+        /// depend on these channels aren't cached until `listen` is called
+        /// again.
+        template<typename S, typename Y>
+        void listen(connection<S> &cnx, const std::vector<std::string> &channels, Y yield) {
+            std::exception_ptr error;
+            try {
+                std::string sql;
+                for ( const auto &channel : channels ) {
+                    sql += "LISTEN \"";
+                    for ( const char c : channel ) {
+                        if ( c == '"' ) sql += '"';
+                        sql += c;
+                    }
+                    sql += "\";";
+                }
+                auto results = pgasio::query(cnx, sql, yield);
+                while ( results.recordset(yield) ) {}
+                {
+                    std::unique_lock<std::mutex> lock{mutex};
+                    for ( const auto &channel : channels ) listening[channel];
+                }
+                while ( cnx.socket.is_open() ) {
+                    auto header = message_header(cnx.socket, yield);
+                    const auto body = header.message_body(cnx.socket, yield);
+                    if ( header.type == 'A' ) {
+                        decoder notification{byte_view{body}};
+                        notification.read_int32(); // The sending process
+                        invalidate(notification.read_string());
+                    }
+                }
+                throw std::runtime_error("The connection listening for notifications closed");
+            } catch ( ... ) {
+                error = std::current_exception();
+            }
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                for ( const auto &channel : channels ) listening.erase(channel);
+                entries.clear();
+            }
+            std::rethrow_exception(error);
+        }
+    };
+
+
+}
@@ -0,0 +1,475 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/network.hpp>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/bind_executor.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+
+
+namespace pgasio {
+
+
+    /// The wire capture format is a sequence of records framed in the same
+    /// way as the Postgres protocol, i.e. a type byte followed by a 32 bit
+    /// big endian length that includes itself:
+    ///
+    /// 1. The eight bytes of `capture_magic`.
+    /// 2. For every read from or write to the socket an `R` (received) or
+    ///     `S` (sent) record holding the 64 bit number of nanoseconds since
+    ///     the capture was started followed by the bytes.
+    ///
+    /// There is no trailer, so a capture from a process that stopped part
+    /// way through can still be replayed up to the last complete record.
+    constexpr const char capture_magic[] = "PGASIOW1";
+
+
+    /// Writes the bytes seen by one or more `capture_socket`s to a capture
+    /// file. Records are collected in memory and written out in large
+    /// chunks using blocking system calls.
+    ///
+    /// Recording is done from completion handlers, so a failure to write
+    /// the file isn't thrown. Instead recording stops and the error is
+    /// available from `error`.
+    ///
+    /// A recorder may be shared by sockets used from different threads.
+    /// Each record is added whilst holding a mutex, so records are never
+    /// interleaved, but they are only in time order per socket.
+    class wire_recorder {
+        mutable std::mutex mutex;
+        int fd;
+        command_buffer buffer;
+        std::chrono::steady_clock::time_point started;
+        std::size_t m_received, m_sent;
+        std::size_t limit;
+        std::error_code m_error;
+
+        /// Write out the buffer. The mutex must be held.
+        void write_buffer() {
+            buffer.finish();
+            const auto data = buffer.data();
+            for ( std::size_t done{}; not m_error && done < data.size(); ) {
+                const auto written = ::write(fd, data.data() + done, data.size() - done);
+                if ( written < 0 ) {
+                    if ( errno == EINTR ) continue;
+                    m_error = std::error_code(errno, std::system_category());
+                } else {
+                    done += written;
+                }
+            }
+            buffer.clear();
+        }
+
+    public:
+        /// Create (or truncate) the file. Records are written out whenever
+        /// `flush_size` bytes have been collected.
+        explicit wire_recorder(const char *path, std::size_t flush_size = 1u << 20)
+        : fd{::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)},
+            buffer(flush_size + (64u << 10)), started{std::chrono::steady_clock::now()},
+            m_received{}, m_sent{}, limit{flush_size}
+        {
+            if ( fd < 0 ) {
+                throw std::system_error(errno, std::system_category(),
+                    std::string("Opening capture file ") + path);
+            }
+            buffer.bytes(byte_view{
+                reinterpret_cast<const unsigned char *>(capture_magic), sizeof(capture_magic) - 1});
+            flush();
+        }
+
+        /// Not copyable
+        wire_recorder(const wire_recorder &) = delete;
+        wire_recorder &operator = (const wire_recorder &) = delete;
+
+        /// Writes out anything still buffered and closes the file
+        ~wire_recorder() {
+            if ( fd >= 0 ) {
+                flush();
+                ::close(fd);
+            }
+        }
+
+        /// The number of bytes recorded in each direction
+        std::size_t received() const {
+            std::unique_lock<std::mutex> lock{mutex};
+            return m_received;
+        }
+        std::size_t sent() const {
+            std::unique_lock<std::mutex> lock{mutex};
+            return m_sent;
+        }
+        /// Set if writing the file failed, after which nothing more is
+        /// recorded
+        std::error_code error() const {
+            std::unique_lock<std::mutex> lock{mutex};
+            return m_error;
+        }
+
+        /// Record the first `bytes` bytes of the buffer sequence. `type` is
+        /// `R` for bytes received from Postgres and `S` for bytes sent.
+        template<typename Buffers>
+        void record(char type, const Buffers &buffers, std::size_t bytes) {
+            if ( not bytes ) return;
+            std::unique_lock<std::mutex> lock{mutex};
+            if ( m_error ) return;
+            (type == 'R' ? m_received : m_sent) += bytes;
+            const std::chrono::nanoseconds at = std::chrono::steady_clock::now() - started;
+            buffer.message(type).int64(at.count());
+            for ( auto b = boost::asio::buffer_sequence_begin(buffers);
+                bytes && b != boost::asio::buffer_sequence_end(buffers); ++b
+            ) {
+                const boost::asio::const_buffer part{*b};
+                const auto size = std::min(bytes, part.size());
+                buffer.bytes(byte_view{static_cast<const unsigned char *>(part.data()), size});
+                bytes -= size;
+            }
+            buffer.finish();
+            if ( buffer.size() >= limit ) write_buffer();
+        }
+
+        /// Write out the records collected so far
+        void flush() {
+            std::unique_lock<std::mutex> lock{mutex};
+            write_buffer();
+        }
+    };
+
+
+    /// Wraps a socket, recording everything read from and written to it
+    /// before passing it on. Put it underneath a `buffered_socket` so that
+    /// the reads are large and the recording stays compact:
+    ///
+    ///     auto recorder = std::make_shared<pgasio::wire_recorder>("session.pgw");
+    ///     auto cnx = pgasio::handshake(
+    ///         pgasio::make_buffered(pgasio::make_capture(std::move(socket), recorder)),
+    ///         user, database, yield);
+    template<typename S>
+    class capture_socket {
+        std::shared_ptr<wire_recorder> recorder;
+
+    public:
+        /// The socket that is being captured
+        S socket;
+
+        capture_socket(S s, std::shared_ptr<wire_recorder> r)
+        : recorder{std::move(r)}, socket{std::move(s)} {
+        }
+
+        /// Make non-copyable
+        capture_socket(const capture_socket &) = delete;
+        capture_socket &operator = (const capture_socket &) = delete;
+        /// Make movable
+        capture_socket(capture_socket &&) = default;
+        capture_socket &operator = (capture_socket &&) = default;
+
+        /// The Boost ASIO stream interface
+        using executor_type = decltype(std::declval<S &>().get_executor());
+        executor_type get_executor() {
+            return socket.get_executor();
+        }
+        auto is_open() { return socket.is_open(); }
+
+        template<typename Buffers, typename Token>
+        auto async_read_some(const Buffers &buffers, Token &&token) {
+            return recorded('R', buffers, std::forward<Token>(token),
+                [this](const auto &buffers, auto handler) {
+                    socket.async_read_some(buffers, std::move(handler));
+                });
+        }
+        template<typename Buffers, typename Token>
+        auto async_write_some(const Buffers &buffers, Token &&token) {
+            return recorded('S', buffers, std::forward<Token>(token),
+                [this](const auto &buffers, auto handler) {
+                    socket.async_write_some(buffers, std::move(handler));
+                });
+        }
+
+    private:
+        /// Start the operation with a handler that records the bytes and
+        /// then calls the caller's handler on its own executor
+        template<typename Buffers, typename Token, typename Start>
+        auto recorded(char type, const Buffers &buffers, Token &&token, Start start) {
+            using signature = void(boost::system::error_code, std::size_t);
+            boost::asio::async_completion<Token, signature> completion{token};
+            auto executor = boost::asio::get_associated_executor(
+                completion.completion_handler, socket.get_executor());
+            start(buffers, boost::asio::bind_executor(executor,
+                [type, buffers, recorder = recorder,
+                    handler = std::move(completion.completion_handler)
+                ](boost::system::error_code error, std::size_t bytes) mutable {
+                    recorder->record(type, buffers, bytes);
+                    handler(error, bytes);
+                }));
+            return completion.result.get();
+        }
+    };
+
+
+    /// Helper to create a `capture_socket`
+    template<typename S> inline
+    auto make_capture(S socket, std::shared_ptr<wire_recorder> recorder) {
+        return capture_socket<S>(std::move(socket), std::move(recorder));
+    }
+
+
+    /// Overload for the transfer function that reads through the capture
+    template<typename S, typename B, typename Y> inline
+    void transfer(
+        capture_socket<S> &source, B &buffer, std::size_t bytes, Y yield
+    ) {
+        boost::asio::async_read(source, boost::asio::buffer(buffer.data(), buffer.size()),
+            boost::asio::transfer_exactly(bytes), yield);
+    }
+
+
+    /// A capture file mapped into memory. It isn't changed once it has been
+    /// loaded, so it can be shared by any number of `replay_socket`s.
+    class wire_recording {
+        struct mapping {
+            const unsigned char *base = nullptr;
+            std::size_t size{};
+            ~mapping() {
+                if ( base ) ::munmap(const_cast<unsigned char *>(base), size);
+            }
+        };
+        mapping memory;
+
+    public:
+        /// A read or write that was captured
+        struct record {
+            /// `R` for bytes received from Postgres, `S` for bytes sent
+            char type;
+            /// When it happened, relative to the start of the capture
+            std::chrono::nanoseconds at;
+            /// The bytes, pointing into the mapped file
+            byte_view bytes;
+        };
+
+        /// Map the file and index its records
+        explicit wire_recording(const char *path) {
+            const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if ( fd < 0 ) {
+                throw std::system_error(errno, std::system_category(),
+                    std::string("Opening capture file ") + path);
+            }
+            struct stat st;
+            if ( ::fstat(fd, &st) < 0 ) {
+                const auto error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::system_category(), "Sizing the capture file");
+            }
+            memory.size = st.st_size;
+            if ( memory.size ) {
+                void *mapped = ::mmap(nullptr, memory.size, PROT_READ, MAP_PRIVATE, fd, 0);
+                const auto error = errno;
+                ::close(fd);
+                if ( mapped == MAP_FAILED ) {
+                    throw std::system_error(error, std::system_category(), "Mapping the capture file");
+                }
+                memory.base = static_cast<const unsigned char *>(mapped);
+            } else {
+                ::close(fd);
+            }
+
+            const std::size_t magic = sizeof(capture_magic) - 1;
+            if ( memory.size < magic ||
+                    std::memcmp(memory.base, capture_magic, magic) != 0 )
+            {
+                throw std::runtime_error(std::string("Not a capture file: ") + path);
+            }
+            decoder file{byte_view{memory.base, memory.size}.slice(magic)};
+            while ( file.remaining() >= 13 ) {
+                const char type = file.read_byte();
+                const auto size = file.read_int32();
+                if ( size < 12 || std::size_t(size - 4) > file.remaining() ) break;
+                if ( type != 'R' && type != 'S' ) {
+                    throw std::runtime_error(
+                        std::string("Unknown capture file record type: ") + type);
+                }
+                const std::chrono::nanoseconds at{file.read_int64()};
+                records.push_back(record{type, at, file.read_bytes(size - 12)});
+            }
+        }
+
+        /// Not copyable
+        wire_recording(const wire_recording &) = delete;
+        wire_recording &operator = (const wire_recording &) = delete;
+
+        /// The records in the order they happened
+        std::vector<record> records;
+    };
+
+
+    /// How quickly a `replay_socket` plays back the bytes received
+    enum class replay_speed {
+        /// Each read waits for as long after the read or write before it as
+        /// it did when it was captured
+        original,
+        /// Everything is delivered as soon as it is asked for
+        maximum
+    };
+
+
+    /// A socket that plays back a capture instead of talking to Postgres, so
+    /// that a real workload can be profiled offline and repeatably. It can
+    /// be used anywhere the captured socket was, including underneath a
+    /// `buffered_socket`.
+    ///
+    /// Reads return the bytes that were received, in the same chunks. The
+    /// bytes written are only used to keep the replay in step: they are
+    /// matched against the recorded writes by size, but their content isn't
+    /// checked, so a replay isn't upset by e.g. authentication nonces that
+    /// differ between runs. Reading past the end of the capture gives an
+    /// end of file error.
+    class replay_socket {
+        boost::asio::io_service *ios;
+        std::shared_ptr<const wire_recording> recording;
+        replay_speed speed;
+        boost::asio::steady_timer timer;
+        /// The record to play next, and how far through it we are
+        std::size_t next, offset;
+        /// When the last record was played, and when it was captured
+        std::chrono::steady_clock::time_point played;
+        std::chrono::nanoseconds played_at;
+        bool open;
+
+        const wire_recording::record *current() const {
+            return next < recording->records.size() ? &recording->records[next] : nullptr;
+        }
+        void finish_record() {
+            played = std::chrono::steady_clock::now();
+            played_at = current()->at;
+            ++next;
+            offset = 0;
+        }
+
+        template<typename Handler>
+        void complete(Handler handler, boost::system::error_code error, std::size_t bytes) {
+            auto executor = boost::asio::get_associated_executor(handler, get_executor());
+            boost::asio::post(executor, [handler = std::move(handler), error, bytes]() mutable {
+                handler(error, bytes);
+            });
+        }
+
+    public:
+        replay_socket(
+            boost::asio::io_service &s, std::shared_ptr<const wire_recording> r,
+            replay_speed p = replay_speed::maximum
+        ) : ios{&s}, recording{std::move(r)}, speed{p}, timer{s},
+            next{}, offset{}, played{std::chrono::steady_clock::now()},
+            played_at{}, open{true}
+        {
+        }
+
+        /// Make non-copyable
+        replay_socket(const replay_socket &) = delete;
+        replay_socket &operator = (const replay_socket &) = delete;
+        /// Make movable
+        replay_socket(replay_socket &&) = default;
+        replay_socket &operator = (replay_socket &&) = delete;
+
+        /// True once the whole capture has been played
+        bool finished() const {
+            return next == recording->records.size();
+        }
+
+        /// The Boost ASIO stream interface
+        using executor_type = boost::asio::io_service::executor_type;
+        executor_type get_executor() {
+            return ios->get_executor();
+        }
+        bool is_open() const { return open; }
+        void close() {
+            open = false;
+            timer.cancel();
+        }
+
+        template<typename Buffers, typename Token>
+        auto async_read_some(const Buffers &buffers, Token &&token) {
+            using signature = void(boost::system::error_code, std::size_t);
+            boost::asio::async_completion<Token, signature> completion{token};
+            /// Writes that weren't made this time round are skipped
+            while ( current() && current()->type == 'S' ) finish_record();
+            auto deliver = [this, buffers](auto handler) {
+                if ( not open ) {
+                    complete(std::move(handler), boost::asio::error::operation_aborted, 0);
+                } else if ( not current() ) {
+                    complete(std::move(handler), boost::asio::error::eof, 0);
+                } else {
+                    auto bytes = current()->bytes;
+                    bytes = bytes.slice(offset);
+                    const auto copied = boost::asio::buffer_copy(
+                        buffers, boost::asio::buffer(bytes.data(), bytes.size()));
+                    offset += copied;
+                    if ( offset == current()->bytes.size() ) finish_record();
+                    complete(std::move(handler), {}, copied);
+                }
+            };
+            if ( speed == replay_speed::original && open && current() && offset == 0 ) {
+                const auto due = played + (current()->at - played_at);
+                if ( due > std::chrono::steady_clock::now() ) {
+                    timer.expires_at(due);
+                    timer.async_wait([deliver,
+                        handler = std::move(completion.completion_handler)
+                    ](boost::system::error_code) mutable {
+                        deliver(std::move(handler));
+                    });
+                    return completion.result.get();
+                }
+            }
+            deliver(std::move(completion.completion_handler));
+            return completion.result.get();
+        }
+
+        template<typename Buffers, typename Token>
+        auto async_write_some(const Buffers &buffers, Token &&token) {
+            using signature = void(boost::system::error_code, std::size_t);
+            boost::asio::async_completion<Token, signature> completion{token};
+            const auto bytes = boost::asio::buffer_size(buffers);
+            if ( not open ) {
+                complete(std::move(completion.completion_handler),
+                    boost::asio::error::operation_aborted, 0);
+            } else {
+                for ( auto left = bytes; left && current() && current()->type == 'S'; ) {
+                    const auto used = std::min(left, current()->bytes.size() - offset);
+                    offset += used;
+                    left -= used;
+                    if ( offset == current()->bytes.size() ) finish_record();
+                }
+                complete(std::move(completion.completion_handler), {}, bytes);
+            }
+            return completion.result.get();
+        }
+    };
+
+
+    /// Overload for the transfer function that reads from the replay
+    template<typename B, typename Y> inline
+    void transfer(replay_socket &source, B &buffer, std::size_t bytes, Y yield) {
+        boost::asio::async_read(source, boost::asio::buffer(buffer.data(), buffer.size()),
+            boost::asio::transfer_exactly(bytes), yield);
+    }
+
+
+}
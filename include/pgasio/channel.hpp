@@ -0,0 +1,226 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/record_block.hpp>
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/post.hpp>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+
+namespace pgasio {
+
+
+    /// A list of coroutines that are suspended waiting for some condition
+    /// to change. The condition must be protected by a mutex which is held
+    /// when calling both `wait` and `notify_all`.
+    class waiting {
+        std::vector<std::function<void()>> waiters;
+
+    public:
+        /// Suspend the coroutine until `notify_all` is called. The lock is
+        /// released whilst the coroutine is suspended and re-acquired before
+        /// this returns. The waiting coroutine is resumed through its own
+        /// executor so this is safe to use across threads.
+        template<typename Y>
+        void wait(std::unique_lock<std::mutex> &lock, Y yield) {
+            boost::asio::async_completion<Y, void(boost::system::error_code)>
+                completion{yield};
+            /// The suspended coroutine counts as outstanding work so that
+            /// the `io_service` doesn't run out of things to do. The guard
+            /// is shared because the waiters must be copyable.
+            auto executor = boost::asio::get_associated_executor(
+                completion.completion_handler);
+            auto work = std::make_shared<decltype(boost::asio::make_work_guard(executor))>(
+                boost::asio::make_work_guard(executor));
+            waiters.push_back(
+                [handler = std::move(completion.completion_handler), executor, work]() mutable {
+                    boost::asio::post(executor, [handler]() mutable {
+                        handler(boost::system::error_code{});
+                    });
+                    work->reset();
+                });
+            lock.unlock();
+            completion.result.get();
+            lock.lock();
+        }
+
+        /// Resume all of the waiting coroutines
+        void notify_all() {
+            auto resume = std::move(waiters);
+            waiters.clear();
+            for ( auto &w : resume ) w();
+        }
+    };
+
+
+    /// The amount of memory held by a `record_block`, used for channel
+    /// memory budgets
+    inline std::size_t memory_size(const record_block &block) {
+        return block.memory_size();
+    }
+
+
+    /// A multi-producer, multi-consumer queue between coroutines that limits
+    /// the memory held by the items in it. When the budget is used up
+    /// producers are suspended until consumers have made room. A single item
+    /// larger than the whole budget is still allowed through when the queue
+    /// is empty.
+    template<typename T>
+    class channel {
+        std::mutex mutex;
+        std::deque<std::pair<T, std::size_t>> items;
+        std::size_t bytes;
+        bool closed;
+        waiting producers, consumers;
+
+    public:
+        /// The number of bytes of items that can be queued before producers
+        /// are suspended
+        const std::size_t budget;
+
+        /// Construct a channel with the memory budget. The default allows
+        /// for 16 of the default sized `record_block`s
+        explicit channel(std::size_t b = 64u << 20)
+        : bytes{}, closed{false}, budget{b} {
+        }
+
+        /// Not copyable or movable
+        channel(const channel &) = delete;
+        channel &operator = (const channel &) = delete;
+
+        /// Add an item that uses the stated number of bytes of memory
+        template<typename Y>
+        void produce(T item, std::size_t size, Y yield) {
+            std::unique_lock<std::mutex> lock{mutex};
+            while ( not closed && items.size() && bytes + size > budget ) {
+                producers.wait(lock, yield);
+            }
+            if ( closed ) throw std::logic_error("Can't produce into a closed channel");
+            items.emplace_back(std::move(item), size);
+            bytes += size;
+            consumers.notify_all();
+        }
+        /// Add an item where the memory is worked out by calling `memory_size`
+        template<typename Y>
+        void produce(T item, Y yield) {
+            const std::size_t size = memory_size(item);
+            produce(std::move(item), size, yield);
+        }
+
+        /// Fetch the next item, waiting until there is one. An empty value is
+        /// returned only once the channel has been closed and drained.
+        template<typename Y>
+        std::optional<T> consume(Y yield) {
+            std::unique_lock<std::mutex> lock{mutex};
+            while ( items.empty() && not closed ) consumers.wait(lock, yield);
+            if ( items.empty() ) return {};
+            std::optional<T> item{std::move(items.front().first)};
+            bytes -= items.front().second;
+            items.pop_front();
+            producers.notify_all();
+            return item;
+        }
+
+        /// Close the channel. Consumers will still get any items that are
+        /// queued before getting an empty value.
+        void close() {
+            std::unique_lock<std::mutex> lock{mutex};
+            closed = true;
+            producers.notify_all();
+            consumers.notify_all();
+        }
+    };
+
+
+    /// Put items that are produced in parallel back into sequence order.
+    /// Each item is given a sequence number (starting at zero) by whatever
+    /// hands out the work and `pop` returns them in that order. At most
+    /// `window` items can be waiting ahead of the next one to be popped, so
+    /// producers that get too far ahead are suspended. Sequence numbers must
+    /// be handed out in the order the work is taken (e.g. as the items are
+    /// put into a `channel`) and the window must be at least as large as the
+    /// number of producers.
+    template<typename T>
+    class reorder {
+        std::mutex mutex;
+        std::map<std::size_t, T> pending;
+        std::size_t next;
+        std::optional<std::size_t> total;
+        waiting producers, consumer;
+
+    public:
+        /// The number of sequence numbers that may be ahead of the next one
+        const std::size_t window;
+
+        explicit reorder(std::size_t w = 16)
+        : next{}, window{w} {
+        }
+
+        /// Not copyable or movable
+        reorder(const reorder &) = delete;
+        reorder &operator = (const reorder &) = delete;
+
+        /// Add the item with the given sequence number
+        template<typename Y>
+        void push(std::size_t sequence, T item, Y yield) {
+            std::unique_lock<std::mutex> lock{mutex};
+            while ( sequence >= next + window ) producers.wait(lock, yield);
+            pending.emplace(sequence, std::move(item));
+            if ( sequence == next ) consumer.notify_all();
+        }
+
+        /// Return the next item in sequence order. An empty value is returned
+        /// once all of the items have been returned.
+        template<typename Y>
+        std::optional<T> pop(Y yield) {
+            std::unique_lock<std::mutex> lock{mutex};
+            while ( true ) {
+                if ( total && next >= *total ) return {};
+                auto found = pending.find(next);
+                if ( found != pending.end() ) {
+                    std::optional<T> item{std::move(found->second)};
+                    pending.erase(found);
+                    ++next;
+                    producers.notify_all();
+                    return item;
+                }
+                consumer.wait(lock, yield);
+            }
+        }
+
+        /// Return the next item in sequence order if it is already available
+        std::optional<T> try_pop() {
+            std::unique_lock<std::mutex> lock{mutex};
+            auto found = pending.find(next);
+            if ( found == pending.end() ) return {};
+            std::optional<T> item{std::move(found->second)};
+            pending.erase(found);
+            ++next;
+            producers.notify_all();
+            return item;
+        }
+
+        /// Record the total number of items that will be pushed
+        void close(std::size_t count) {
+            std::unique_lock<std::mutex> lock{mutex};
+            total = count;
+            consumer.notify_all();
+        }
+    };
+
+
+}
@@ -7,9 +7,15 @@
 
 
 #include <pgasio/network.hpp>
+#include <pgasio/statement_cache.hpp>
 
+#include <boost/asio/connect.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/local/stream_protocol.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <optional>
 
 
 namespace pgasio {
@@ -17,14 +23,21 @@ namespace pgasio {
 
     template<typename S>
     class connection;
+    class type_registry;
 
 
-    /// Perform a handshake that assumes to authentication or connection
-    /// options are needed.
+    /// Extra parameters sent to Postgres in the startup message, e.g.
+    /// `{"application_name", "exporter"}` or `{"replication", "database"}`
+    using startup_options = std::vector<std::pair<std::string, std::string>>;
+
+
+    /// Perform a handshake that assumes to authentication is needed. The
+    /// options are added to the startup message.
     template<typename S, typename Y> inline
     connection<S> handshake(
         S socket,
         const char *user, const char *database,
+        const startup_options &options,
         Y yield
     ) {
         command cmd{0}; // The initial connect doesn't use a message type char
@@ -35,10 +48,15 @@ namespace pgasio {
             cmd.c_str("database");
             cmd.c_str(database);
         }
+        for ( const auto &option : options ) {
+            cmd.c_str(option.first.c_str());
+            cmd.c_str(option.second.c_str());
+        }
         cmd.int8(0);
         cmd.send(socket, yield);
         std::unordered_map<std::string, std::string> settings;
         int32_t process_id{}, secret{};
+        char status{};
         while ( socket.is_open() ) {
             auto header = message_header(socket, yield);
             auto body = header.message_body(socket, yield);
@@ -64,7 +82,9 @@ namespace pgasio {
                 }
                 break;
             case 'Z':
-                return connection<S>(std::move(socket), std::move(settings), process_id, secret);
+                status = decode.read_byte();
+                return connection<S>(std::move(socket), std::move(settings),
+                    process_id, secret, status);
             default:
                 throw std::runtime_error(
                     std::string("Unknown connection message type: ") + header.type);
@@ -74,19 +94,34 @@ namespace pgasio {
     }
 
 
+    /// Perform a handshake that assumes to authentication or connection
+    /// options are needed.
+    template<typename S, typename Y> inline
+    connection<S> handshake(
+        S socket,
+        const char *user, const char *database,
+        Y yield
+    ) {
+        return handshake(std::move(socket), user, database, startup_options{}, yield);
+    }
+
+
     /// The connection to the database
     template<typename S>
     class connection {
         template<typename Ss, typename Y> friend
-            connection<Ss> handshake(Ss, const char *, const char *, Y);
+            connection<Ss> handshake(
+                Ss, const char *, const char *, const startup_options &, Y);
 
         connection(
             S s, std::unordered_map<std::string, std::string> set,
-            int32_t pid, int32_t sec
+            int32_t pid, int32_t sec, char status
         ): socket(std::move(s)),
             settings(std::move(set)),
             process_id(pid),
-            secret(sec)
+            secret(sec),
+            transaction_status(status),
+            memory(std::pmr::get_default_resource())
         {
         }
 
@@ -99,9 +134,113 @@ namespace pgasio {
         const int32_t process_id;
         /// The secret used for cancellations
         const int32_t secret;
+        /// The transaction status from the last _ReadyForQuery_ (`Z`)
+        /// message: `I` when idle, `T` inside a transaction block and `E`
+        /// inside a transaction block that has failed
+        char transaction_status;
+        /// Messages to be sent to Postgres are built up here. Several
+        /// messages can be queued and then sent in a single write
+        command_buffer commands;
+        /// Prepared statements used by `query`. The cache is turned on by
+        /// giving it a capacity
+        statement_cache statements;
+        /// The memory resource used for the `record_block`s and message
+        /// bodies read by `query` and `recordset`. Set it to a per-request
+        /// arena (e.g. `std::pmr::monotonic_buffer_resource`) so that all of
+        /// a query's memory can be released in one go. The resource must
+        /// outlive the blocks allocated from it.
+        std::pmr::memory_resource *memory;
+        /// The database's types, once they have been loaded by `load_types`.
+        /// Connections to the same database can share them.
+        std::shared_ptr<const type_registry> types;
+        /// The last error Postgres reported to one of the calls that take an
+        /// `error_code` rather than throwing
+        error_response error;
     };
 
 
+    /// Skip the rest of the reply to a command up to and including its
+    /// _ReadyForQuery_ (`Z`) message. This is used after Postgres has
+    /// reported an error so that the connection can carry on being used.
+    template<typename S, typename Y> inline
+    void synchronise(connection<S> &cnx, Y yield) {
+        while ( cnx.socket.is_open() ) {
+            auto header = read_header(cnx.socket, yield);
+            const auto body = header.message_body(cnx.socket, cnx.memory, yield);
+            if ( header.type == 'Z' ) {
+                cnx.transaction_status = decoder{byte_view{body}}.read_byte();
+                return;
+            }
+        }
+        throw std::runtime_error("The Postgres connection closed whilst re-synchronising");
+    }
+
+
+    /// Call the function. If it throws a `postgres_error` then the rest of
+    /// the command's reply is skipped before the error is re-thrown, so the
+    /// connection is ready for the next command.
+    template<typename S, typename F, typename Y> inline
+    auto recover(connection<S> &cnx, F f, Y yield) -> decltype(f()) {
+        std::exception_ptr error;
+        try {
+            return f();
+        } catch ( postgres_error & ) {
+            /// The coroutine mustn't be suspended inside the catch block
+            error = std::current_exception();
+        }
+        synchronise(cnx, yield);
+        std::rethrow_exception(error);
+    }
+
+
+    /// Call the function, turning any exception that means the connection
+    /// can't be used any more into an error code, in which case the result
+    /// of `otherwise` is returned. Errors reported by Postgres become codes
+    /// in the `sqlstate_category`.
+    template<typename F, typename O> inline
+    auto capture(boost::system::error_code &ec, F f, O otherwise) -> decltype(f()) {
+        try {
+            return f();
+        } catch ( boost::system::system_error &e ) {
+            ec = e.code();
+        } catch ( postgres_error &e ) {
+            ec = sqlstate_error(e.sqlstate());
+        } catch ( std::runtime_error & ) {
+            ec = errc::protocol_error;
+        } catch ( std::logic_error & ) {
+            ec = errc::protocol_error;
+        }
+        return otherwise();
+    }
+
+
+    /// Perform a handshake without throwing. If it fails then `ec` is set
+    /// and an empty value is returned.
+    template<typename S, typename Y> inline
+    std::optional<connection<S>> handshake(
+        S socket,
+        const char *user, const char *database,
+        const startup_options &options,
+        boost::system::error_code &ec,
+        Y yield
+    ) {
+        ec = {};
+        return capture(ec, [&]() {
+            return std::optional<connection<S>>{
+                handshake(std::move(socket), user, database, options, yield)};
+        }, []() { return std::optional<connection<S>>{}; });
+    }
+    template<typename S, typename Y> inline
+    std::optional<connection<S>> handshake(
+        S socket,
+        const char *user, const char *database,
+        boost::system::error_code &ec,
+        Y yield
+    ) {
+        return handshake(std::move(socket), user, database, startup_options{}, ec, yield);
+    }
+
+
     /// Return a unix domain socket for the given location
     template<typename L, typename Y> inline
     auto unix_domain_socket(
@@ -114,5 +253,21 @@ namespace pgasio {
     }
 
 
+    /// Return a TCP socket connected to the host and port (or service
+    /// name). Nagle's algorithm is turned off because the protocol sends
+    /// small messages and waits for the replies.
+    template<typename Y> inline
+    auto tcp_socket(
+        boost::asio::io_service &ios, const std::string &host,
+        const std::string &port, Y yield
+    ) {
+        boost::asio::ip::tcp::resolver resolver{ios};
+        boost::asio::ip::tcp::socket socket{ios};
+        boost::asio::async_connect(socket, resolver.async_resolve(host, port, yield), yield);
+        socket.set_option(boost::asio::ip::tcp::no_delay{true});
+        return socket;
+    }
+
+
 }
 
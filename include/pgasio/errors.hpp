@@ -8,9 +8,15 @@
 
 #include <pgasio/memory.hpp>
 
+#include <boost/system/error_code.hpp>
+
+#include <cstring>
 #include <exception>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 
 namespace pgasio {
@@ -31,6 +37,158 @@ namespace pgasio {
         const char *what() const noexcept override {
             return "Postgres returned an error";
         }
+
+        /// The five character SQLSTATE code for the error
+        std::string_view sqlstate() const {
+            const auto code = messages.find('C');
+            return code == messages.end() ? std::string_view{} : code->second;
+        }
+    };
+
+
+    /// Errors found by pgasio itself rather than reported by Postgres
+    enum class errc {
+        /// Postgres sent something that doesn't fit the protocol, or the
+        /// connection closed part way through a reply
+        protocol_error = 1,
+        /// A `NULL` was found in a column that can't hold one. The rest of
+        /// the recordset has been read, so the connection can still be used
+        unexpected_null = 2
+    };
+
+    inline const boost::system::error_category &pgasio_category() {
+        static const class : public boost::system::error_category {
+        public:
+            const char *name() const noexcept override {
+                return "pgasio";
+            }
+            std::string message(int value) const override {
+                switch ( errc(value) ) {
+                case errc::protocol_error: return "Postgres protocol error";
+                case errc::unexpected_null: return "Unexpected NULL";
+                }
+                return "Unknown pgasio error";
+            }
+        } category;
+        return category;
+    }
+    inline boost::system::error_code make_error_code(errc e) {
+        return boost::system::error_code{int(e), pgasio_category()};
+    }
+
+
+    /// Errors reported by Postgres are given error codes in this category.
+    /// The value is the SQLSTATE read as a base 36 number, so the class of
+    /// an error and the error itself can be tested for without needing the
+    /// message it came in.
+    inline const boost::system::error_category &sqlstate_category();
+
+    /// The error code for the SQLSTATE, e.g. `sqlstate_error("40001")` for
+    /// a serialisation failure
+    inline boost::system::error_code sqlstate_error(std::string_view state) {
+        int value{};
+        for ( const char c : state.substr(0, 5) ) {
+            value *= 36;
+            if ( c >= '0' && c <= '9' ) value += c - '0';
+            else if ( c >= 'A' && c <= 'Z' ) value += c - 'A' + 10;
+        }
+        return boost::system::error_code{value, sqlstate_category()};
+    }
+    /// The SQLSTATE of an error code from the `sqlstate_category`. For any
+    /// other error code an empty string is returned.
+    inline std::string sqlstate(const boost::system::error_code &ec) {
+        if ( ec.category() != sqlstate_category() ) return std::string{};
+        std::string state(5, '0');
+        for ( auto value = ec.value(), at = 4; at >= 0; value /= 36, --at ) {
+            const char digit = value % 36;
+            state[at] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        }
+        return state;
+    }
+
+    inline const boost::system::error_category &sqlstate_category() {
+        static const class : public boost::system::error_category {
+        public:
+            const char *name() const noexcept override {
+                return "sqlstate";
+            }
+            std::string message(int value) const override {
+                return "SQLSTATE " + sqlstate(boost::system::error_code{value, *this});
+            }
+        } category;
+        return category;
+    }
+
+
+    /// The body of an _ErrorResponse_ (`E`) message. Nothing is copied out
+    /// of the message, the fields are found when they're asked for.
+    class error_response {
+        std::vector<unsigned char> body;
+
+    public:
+        error_response() = default;
+        explicit error_response(std::vector<unsigned char> b)
+        : body(std::move(b)) {
+        }
+
+        /// True if there is an error
+        explicit operator bool () const {
+            return body.size();
+        }
+        void clear() {
+            body.clear();
+        }
+
+        /// Return the field with the given type, or an empty string if the
+        /// message doesn't have it
+        std::string_view field(char type) const {
+            std::string_view found;
+            each([&](char t, std::string_view value) {
+                if ( t == type && found.empty() ) found = value;
+            });
+            return found;
+        }
+
+        /// The five character SQLSTATE code
+        std::string_view sqlstate() const {
+            return field('C');
+        }
+        /// The SQLSTATE as an error code
+        boost::system::error_code code() const {
+            return sqlstate_error(sqlstate());
+        }
+        /// The severity, e.g. `ERROR`. This is never localised
+        std::string_view severity() const {
+            const auto severity = field('V');
+            return severity.size() ? severity : field('S');
+        }
+        /// The primary human-readable message
+        std::string_view message() const {
+            return field('M');
+        }
+
+        /// All of the fields, in the form used by `postgres_error`
+        postgres_error::messages_type messages() const {
+            postgres_error::messages_type fields;
+            each([&](char type, std::string_view value) {
+                fields[type] = std::string{value};
+            });
+            return fields;
+        }
+
+        /// Call `f(type, value)` for each field in the message
+        template<typename F>
+        void each(F f) const {
+            const auto end = reinterpret_cast<const char *>(body.data() + body.size());
+            for ( auto at = reinterpret_cast<const char *>(body.data()); at < end && *at; ) {
+                const auto value = at + 1;
+                const auto terminator = static_cast<const char *>(
+                    std::memchr(value, 0, end - value));
+                if ( not terminator ) return;
+                f(*at, std::string_view(value, terminator - value));
+                at = terminator + 1;
+            }
+        }
     };
 
 
@@ -45,3 +203,9 @@ namespace pgasio {
 
 }
 
+
+namespace boost::system {
+    template<>
+    struct is_error_code_enum<pgasio::errc> : public std::true_type {};
+}
+
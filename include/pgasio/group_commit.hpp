@@ -0,0 +1,273 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/channel.hpp>
+#include <pgasio/query.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <chrono>
+#include <deque>
+
+
+namespace pgasio {
+
+
+    /// The rows returned to one caller of `group_commit::execute`. Most
+    /// statements sent this way return no rows, but e.g. an
+    /// `INSERT ... RETURNING` will.
+    struct grouped_result {
+        /// The columns of the last recordset the statement returned
+        std::vector<column_meta> columns;
+        /// The rows of that recordset
+        std::vector<record_block> blocks;
+    };
+
+
+    /// Collects small statements from many coroutines and runs them on a
+    /// single connection as one pipelined transaction, i.e. `BEGIN`, the
+    /// statements and then `COMMIT` in a single write. This saves a round
+    /// trip and a commit on the server for every statement, at the cost of
+    /// waiting up to `window` for a batch to fill up.
+    ///
+    /// Each caller gets back its own results or its own error. When a
+    /// statement fails Postgres aborts the whole transaction, so its caller
+    /// gets the `postgres_error` and the rest of the batch is run again in
+    /// a new transaction without it. If the `COMMIT` itself fails then every
+    /// caller in the batch gets that error.
+    ///
+    /// `execute` can be called from coroutines on any thread. The
+    /// statements must be complete commands and not open or close
+    /// transactions themselves. If the connection's statement cache is used
+    /// then each must be a single statement.
+    template<typename S>
+    class group_commit {
+        struct item {
+            std::string sql;
+            grouped_result result;
+            std::exception_ptr error;
+            bool done = false;
+            waiting finished;
+
+            item(std::string s)
+            : sql(std::move(s)) {
+            }
+        };
+        using batch_type = std::vector<std::shared_ptr<item>>;
+
+        struct state : public std::enable_shared_from_this<state> {
+            connection<S> cnx;
+            boost::asio::io_service::strand strand;
+            boost::asio::steady_timer timer;
+            const std::chrono::steady_clock::duration window;
+            const std::size_t max_batch;
+
+            std::mutex mutex;
+            std::deque<std::shared_ptr<item>> queue;
+            /// True whilst the batcher is waiting on the timer
+            bool sleeping = false;
+            bool closed = false;
+            /// Set if the connection fails
+            std::exception_ptr broken;
+
+            state(
+                boost::asio::io_service &ios, connection<S> c,
+                std::chrono::steady_clock::duration w, std::size_t m
+            ) : cnx(std::move(c)), strand{ios}, timer{ios}, window{w},
+                max_batch{std::max(m, std::size_t{1})}
+            {
+            }
+
+            /// Called with the lock held
+            void wake() {
+                if ( sleeping ) {
+                    sleeping = false;
+                    strand.post([self = this->shared_from_this()]() { self->timer.cancel(); });
+                }
+            }
+
+            template<typename Y>
+            void sleep(std::chrono::steady_clock::time_point until, Y yield) {
+                timer.expires_at(until);
+                boost::system::error_code ignored;
+                timer.async_wait(yield[ignored]);
+            }
+
+            void complete(const batch_type &batch, std::exception_ptr error) {
+                std::unique_lock<std::mutex> lock{mutex};
+                for ( auto &i : batch ) {
+                    i->error = error;
+                    i->done = true;
+                    i->finished.notify_all();
+                }
+            }
+
+            template<typename Y>
+            void run(batch_type batch, Y yield) {
+                while ( batch.size() ) {
+                    std::exception_ptr failed, batch_error;
+                    std::size_t failed_at = batch.size();
+                    try {
+                        auto begin = queue_query(cnx, "BEGIN");
+                        std::vector<resultset<S>> results;
+                        results.reserve(batch.size());
+                        for ( auto &i : batch ) results.push_back(queue_query(cnx, i->sql));
+                        auto commit = queue_query(cnx, "COMMIT");
+                        flush(cnx, yield);
+                        /// Every reply must be read, even after an error,
+                        /// so that the connection stays in step
+                        auto attempt = [](auto f) -> std::exception_ptr {
+                            try {
+                                f();
+                                return nullptr;
+                            } catch ( postgres_error & ) {
+                                return std::current_exception();
+                            }
+                        };
+                        batch_error = attempt([&]() { drain(begin, yield); });
+                        for ( std::size_t index{}; index < batch.size(); ++index ) {
+                            auto error = attempt([&]() {
+                                read(results[index], batch[index]->result, yield);
+                            });
+                            /// Only the first error belongs to its statement.
+                            /// The ones after it are because the transaction
+                            /// was aborted
+                            if ( error && not failed ) {
+                                failed = error;
+                                failed_at = index;
+                            }
+                        }
+                        auto commit_error = attempt([&]() { drain(commit, yield); });
+                        if ( not batch_error ) batch_error = commit_error;
+                    } catch ( ... ) {
+                        batch_error = std::current_exception();
+                        std::unique_lock<std::mutex> lock{mutex};
+                        broken = batch_error;
+                        closed = true;
+                    }
+                    if ( batch_error ) {
+                        complete(batch, batch_error);
+                        return;
+                    } else if ( failed ) {
+                        complete({batch[failed_at]}, failed);
+                        batch.erase(batch.begin() + failed_at);
+                        for ( auto &i : batch ) i->result = grouped_result{};
+                    } else {
+                        complete(batch, nullptr);
+                        return;
+                    }
+                }
+            }
+
+            template<typename Y>
+            static void drain(resultset<S> &results, Y yield) {
+                while ( auto rs = results.recordset(yield) ) {
+                    while ( rs.next_block(yield) );
+                }
+            }
+            template<typename Y>
+            static void read(resultset<S> &results, grouped_result &into, Y yield) {
+                while ( auto rs = results.recordset(yield) ) {
+                    into.columns.assign(rs.columns().begin(), rs.columns().end());
+                    into.blocks.clear();
+                    while ( auto block = rs.next_block(yield) ) {
+                        into.blocks.push_back(std::move(block));
+                    }
+                }
+            }
+        };
+        std::shared_ptr<state> batcher;
+
+    public:
+        /// Take over the connection and start the batching coroutine on its
+        /// own strand of the `io_service`. A batch is sent once `max_batch`
+        /// statements are waiting, or `window` after the first of them
+        /// arrived.
+        group_commit(
+            boost::asio::io_service &ios, connection<S> cnx,
+            std::chrono::steady_clock::duration window = std::chrono::milliseconds{2},
+            std::size_t max_batch = 100
+        ) : batcher{std::make_shared<state>(ios, std::move(cnx), window, max_batch)} {
+            boost::asio::spawn(batcher->strand, [b = batcher](auto yield) {
+                while ( true ) {
+                    std::unique_lock<std::mutex> lock{b->mutex};
+                    if ( b->broken ) break;
+                    if ( b->queue.empty() ) {
+                        if ( b->closed ) break;
+                        b->sleeping = true;
+                        lock.unlock();
+                        b->sleep(std::chrono::steady_clock::time_point::max(), yield);
+                        continue;
+                    }
+                    if ( b->queue.size() < b->max_batch && not b->closed ) {
+                        b->sleeping = true;
+                        lock.unlock();
+                        b->sleep(std::chrono::steady_clock::now() + b->window, yield);
+                        lock.lock();
+                        b->sleeping = false;
+                    }
+                    const auto size = std::min(b->queue.size(), b->max_batch);
+                    batch_type batch(b->queue.begin(), b->queue.begin() + size);
+                    b->queue.erase(b->queue.begin(), b->queue.begin() + size);
+                    lock.unlock();
+                    b->run(std::move(batch), yield);
+                }
+                /// If the connection broke then fail anything left
+                std::unique_lock<std::mutex> lock{b->mutex};
+                for ( auto &i : b->queue ) {
+                    i->error = b->broken;
+                    i->done = true;
+                    i->finished.notify_all();
+                }
+                b->queue.clear();
+            });
+        }
+
+        /// Not copyable
+        group_commit(const group_commit &) = delete;
+        group_commit &operator = (const group_commit &) = delete;
+
+        /// Closes the group commit. Statements already waiting are still sent
+        ~group_commit() {
+            close();
+        }
+
+        /// Stop accepting statements. The ones already waiting are sent
+        /// straight away, without waiting for the batch to fill up.
+        void close() {
+            std::unique_lock<std::mutex> lock{batcher->mutex};
+            batcher->closed = true;
+            batcher->wake();
+        }
+
+        /// Run the SQL as part of the next batch, suspending the coroutine
+        /// until the batch has been committed. A `postgres_error` is thrown
+        /// if the statement or the commit fails.
+        template<typename Y>
+        grouped_result execute(std::string sql, Y yield) {
+            auto waiting = std::make_shared<item>(std::move(sql));
+            std::unique_lock<std::mutex> lock{batcher->mutex};
+            if ( batcher->broken ) std::rethrow_exception(batcher->broken);
+            if ( batcher->closed ) {
+                throw std::logic_error("Can't execute a statement after the group commit has closed");
+            }
+            batcher->queue.push_back(waiting);
+            if ( batcher->queue.size() == 1 || batcher->queue.size() >= batcher->max_batch ) {
+                batcher->wake();
+            }
+            while ( not waiting->done ) waiting->finished.wait(lock, yield);
+            if ( waiting->error ) std::rethrow_exception(waiting->error);
+            return std::move(waiting->result);
+        }
+    };
+
+
+}
@@ -10,6 +10,8 @@
 
 #include <array>
 #include <cassert>
+#include <functional>
+#include <memory_resource>
 #include  <vector>
 
 
@@ -33,12 +35,13 @@ namespace pgasio {
         : m_data(nullptr), m_size(0u) {
         }
 
-        /// Construct from a vector
-        array_view(std::vector<value_type> &v)
+        /// Construct from a vector, which may use any allocator
+        template<typename A>
+        array_view(std::vector<value_type, A> &v)
         : m_data(v.data()), m_size(v.size()) {
         }
-        template<typename T>
-        array_view(const std::vector<T> &v)
+        template<typename T, typename A>
+        array_view(const std::vector<T, A> &v)
         : m_data(v.data()), m_size(v.size()) {
         }
         template<typename T, std::size_t N>
@@ -114,25 +117,73 @@ namespace pgasio {
     /// A slab of memory that can be chopped up without regard to
     /// alignment issues.
     class unaligned_slab {
-        std::vector<unsigned char> buffer;
+        /// Called to give the memory back when the slab is destroyed
+        using release_function = std::function<void(raw_memory)>;
+
+        raw_memory buffer;
         std::size_t base;
+        release_function release;
+
+        void free() {
+            if ( release ) {
+                release(buffer);
+            } else {
+                delete[] buffer.data();
+            }
+        }
 
     public:
         /// Create an empty slab
         unaligned_slab()
         : base{} {
         }
-        /// Create a slab for the requested number of bytes
+        /// Create a slab for the requested number of bytes. The memory is
+        /// not initialised.
         unaligned_slab(std::size_t bytes)
-        : buffer(bytes), base{} {
+        : buffer(new unsigned char[bytes], bytes), base{} {
+        }
+        /// Create a slab for the requested number of bytes using memory from
+        /// the memory resource, e.g. a `std::pmr::monotonic_buffer_resource`
+        /// for each request or a `std::pmr::unsynchronized_pool_resource`
+        /// for each thread. The resource must outlive the slab.
+        unaligned_slab(std::size_t bytes, std::pmr::memory_resource *memory)
+        : buffer(static_cast<unsigned char *>(memory->allocate(bytes, 1)), bytes),
+            base{},
+            release([memory](raw_memory m) { memory->deallocate(m.data(), m.size(), 1); })
+        {
+        }
+        /// Create a slab that uses memory that has been allocated elsewhere.
+        /// The release function is called with the memory when the slab is
+        /// destroyed.
+        unaligned_slab(raw_memory memory, release_function r)
+        : buffer{memory}, base{}, release(std::move(r)) {
+        }
+        ~unaligned_slab() {
+            free();
         }
 
         /// Not copyable
         unaligned_slab(const unaligned_slab &) = delete;
         unaligned_slab &operator = (const unaligned_slab &) = delete;
         /// Moveable
-        unaligned_slab(unaligned_slab &&) = default;
-        unaligned_slab &operator = (unaligned_slab &&) = default;
+        unaligned_slab(unaligned_slab &&s)
+        : buffer{s.buffer}, base{s.base}, release(std::move(s.release)) {
+            s.buffer = raw_memory{};
+            s.base = 0u;
+            s.release = nullptr;
+        }
+        unaligned_slab &operator = (unaligned_slab &&s) {
+            if ( this != &s ) {
+                free();
+                buffer = s.buffer;
+                base = s.base;
+                release = std::move(s.release);
+                s.buffer = raw_memory{};
+                s.base = 0u;
+                s.release = nullptr;
+            }
+            return *this;
+        }
 
         /// How many bytes are still left in this slab
         std::size_t remaining() const {
@@ -143,6 +194,11 @@ namespace pgasio {
             return base;
         }
 
+        /// The memory that has been allocated so far
+        byte_view allocated_memory() const {
+            return byte_view(buffer.data(), base);
+        }
+
         /// Allocate a chunk of the slab of the requested size and returns
         /// a pointer to it
         raw_memory allocate(std::size_t bytes) {
@@ -153,7 +209,6 @@ namespace pgasio {
         }
     };
 
-
 }
 
 
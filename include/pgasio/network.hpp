@@ -12,10 +12,11 @@
 #include <boost/asio/basic_stream_socket.hpp>
 #include <boost/asio/read.hpp>
 #include <boost/asio/spawn.hpp>
-#include <boost/asio/streambuf.hpp>
 #include <boost/asio/write.hpp>
+#include <boost/endian/conversion.hpp>
 
 #include <array>
+#include <cstring>
 
 
 namespace pgasio {
@@ -43,8 +44,9 @@ namespace pgasio {
         decoder(raw_memory b)
         : buffer(b.data(), b.size()) {
         }
-        decoder(const std::vector<unsigned char> &b)
-        : decoder(byte_view(b)) {
+        template<typename A>
+        decoder(const std::vector<unsigned char, A> &b)
+        : decoder(byte_view(b.data(), b.size())) {
         }
 
         std::size_t remaining() const {
@@ -65,6 +67,11 @@ namespace pgasio {
             return (read_byte() << 24) + (read_byte() << 16)
                 + (read_byte() << 8) + read_byte();
         }
+        int64_t read_int64() {
+            const int64_t high = uint32_t(read_int32());
+            const int64_t low = uint32_t(read_int32());
+            return (high << 32) + low;
+        }
 
         byte_view read_bytes(std::size_t bytes) {
             if ( remaining() < bytes ) throw end_of_message();
@@ -105,110 +112,301 @@ namespace pgasio {
             transfer(socket, body, body_size, yield);
             return body;
         }
+        /// Read the message body into memory from the memory resource
+        template<typename S, typename Y> inline
+        std::pmr::vector<unsigned char> message_body(
+            S &socket, std::pmr::memory_resource *memory, Y yield
+        ) {
+            std::pmr::vector<unsigned char> body(body_size, memory);
+            transfer(socket, body, body_size, yield);
+            return body;
+        }
     };
 
 
-    /// Read a message header, but not the message body. If the message is an
-    /// error message then turn it into an exception.
+    /// Read a message header, but not the message body. Error messages are
+    /// returned in the same way as any other message.
     template<typename S, typename Y> inline
-    auto message_header(S &socket, Y yield) {
+    header read_header(S &socket, Y yield) {
         std::array<unsigned char, 5> buffer;
         transfer(socket, buffer, buffer.size(), yield);
         uint32_t bytes = (buffer[1] << 24) +
             (buffer[2] << 16) + (buffer[3] << 8) + buffer[4];
-        header head{char(buffer[0]), bytes};
+        return header{char(buffer[0]), bytes};
+    }
+
+
+    /// Decode the fields in the body of an _ErrorResponse_ (`E`) or
+    /// _NoticeResponse_ (`N`) message
+    inline postgres_error::messages_type error_fields(decoder msg) {
+        postgres_error::messages_type messages;
+        while ( msg.remaining() > 1 ) {
+            const auto type = msg.read_byte();
+            messages[type] = msg.read_string();
+        }
+        return messages;
+    }
+
+
+    /// Read a message header, but not the message body. If the message is an
+    /// error message then its body is read and stored in `failed`, and the
+    /// `E` header is returned so the caller knows to stop. If `failed` is
+    /// null then the error is thrown as a `postgres_error` instead.
+    template<typename S, typename Y> inline
+    header message_header(S &socket, error_response *failed, Y yield) {
+        auto head = read_header(socket, yield);
         if ( head.type == 'E' ) {
-            const auto body = head.message_body(socket, yield);
-            decoder msg{byte_view{body}};
-            postgres_error::messages_type messages;
-            while ( msg.remaining() > 1 ) {
-                const auto type = msg.read_byte();
-                messages[type] = msg.read_string();
-            }
-            throw postgres_error(std::move(messages));
-        } else {
-            return head;
+            auto body = head.message_body(socket, yield);
+            if ( not failed ) throw postgres_error(error_fields(byte_view{body}));
+            *failed = error_response{std::move(body)};
         }
+        return head;
+    }
+
+
+    /// Read a message header, but not the message body. If the message is an
+    /// error message then turn it into an exception.
+    template<typename S, typename Y> inline
+    auto message_header(S &socket, Y yield) {
+        return message_header(socket, nullptr, yield);
     }
 
 
-    /// Helper to assemble a command message to be sent to Postgres
+    /// A reusable buffer that frontend messages are assembled in. Any number
+    /// of messages can be put into the buffer one after the other and then
+    /// sent together in a single write. The memory is kept when the buffer
+    /// is cleared so a buffer that is re-used doesn't need to allocate.
+    ///
+    /// Large values can be added using `reference`. They are not copied into
+    /// the buffer, but are sent from where they are using a gathered write.
+    class command_buffer {
+        std::vector<unsigned char> buffer;
+        std::size_t used;
+        /// The position of the length of the message currently being built
+        std::size_t length_at;
+        bool in_message;
+        /// Memory owned by the caller, and the position in the buffer that
+        /// each one is sent at
+        std::vector<std::pair<std::size_t, byte_view>> references;
+        /// The number of referenced bytes in total, and when the current
+        /// message was started
+        std::size_t referenced, referenced_at;
+
+        /// Return a pointer to `bytes` more bytes at the end of the buffer
+        unsigned char *extend(std::size_t bytes) {
+            if ( used + bytes > buffer.size() ) {
+                buffer.resize(std::max(buffer.size() * 2, used + bytes));
+            }
+            auto at = buffer.data() + used;
+            used += bytes;
+            return at;
+        }
+        template<typename I>
+        void store(unsigned char *at, I value) {
+            const auto be = boost::endian::native_to_big(value);
+            std::memcpy(at, &be, sizeof(I));
+        }
+
+    public:
+        /// Construct a buffer with some initial capacity
+        explicit command_buffer(std::size_t capacity = 4u << 10)
+        : buffer(capacity), used{}, length_at{}, in_message{false},
+            referenced{}, referenced_at{}
+        {
+        }
+
+        /// Values smaller than this are copied by `reference` as that is
+        /// cheaper than an extra buffer in the gathered write
+        static constexpr std::size_t copy_below = 2u << 10;
+
+        /// Start a new message, finishing any current one. The very first
+        /// message sent after connecting doesn't have a message type. Send
+        /// zero for this case.
+        command_buffer &message(char type) {
+            finish();
+            if ( type ) *extend(1) = type;
+            length_at = used;
+            referenced_at = referenced;
+            extend(4);
+            in_message = true;
+            return *this;
+        }
+
+        /// Finish the current message by filling in its length
+        command_buffer &finish() {
+            if ( in_message ) {
+                store(buffer.data() + length_at,
+                    int32_t(used - length_at + referenced - referenced_at));
+                in_message = false;
+            }
+            return *this;
+        }
+
+        /// Add the specified bytes to the message
+        template<typename B, typename = std::enable_if_t<std::is_integral<B>::value>>
+        command_buffer &bytes(array_view<B> av) {
+            static_assert(sizeof(B) == 1, "Must add an array of bytes");
+            if ( av.size() ) std::memcpy(extend(av.size()), av.data(), av.size());
+            return *this;
+        }
+
+        /// Add the bytes to the message without copying them. The memory
+        /// must stay valid until the buffer has been sent or cleared.
+        command_buffer &reference(byte_view av) {
+            if ( av.size() < copy_below ) return bytes(av);
+            references.emplace_back(used, av);
+            referenced += av.size();
+            return *this;
+        }
+
+        /// Add a single byte to the message
+        template<typename B, typename = std::enable_if_t<std::is_integral<B>::value>>
+        command_buffer &byte(B b) {
+            static_assert(sizeof(B) == 1, "Must add a single byte");
+            *extend(1) = b;
+            return *this;
+        }
+
+        /// Write an int8
+        command_buffer &int8(int8_t c) {
+            return byte(c);
+        }
+        /// Write an int16
+        command_buffer &int16(int16_t i) {
+            store(extend(2), i);
+            return *this;
+        }
+        /// Write an int32
+        command_buffer &int32(int32_t i) {
+            store(extend(4), i);
+            return *this;
+        }
+        /// Write an int64
+        command_buffer &int64(int64_t i) {
+            store(extend(8), i);
+            return *this;
+        }
+
+        /// Write a C string, including the terminating NIL character
+        command_buffer &c_str(const char *s) {
+            const auto length = std::strlen(s) + 1;
+            std::memcpy(extend(length), s, length);
+            return *this;
+        }
+        /// Write a string, adding a terminating NIL character
+        command_buffer &c_str(const std::string &s) {
+            const auto length = s.size();
+            std::memcpy(extend(length + 1), s.c_str(), length + 1);
+            return *this;
+        }
+
+        /// The number of bytes in the messages, including referenced bytes
+        std::size_t size() const {
+            return used + referenced;
+        }
+        /// True if there is nothing in the buffer
+        bool empty() const {
+            return used == 0u;
+        }
+        /// The messages in the buffer. Any current message must have been
+        /// finished for this to be complete, and there must be no referenced
+        /// bytes.
+        byte_view data() const {
+            assert(references.empty());
+            return byte_view(buffer.data(), used);
+        }
+
+        /// Throw away the content of the buffer, keeping the memory
+        void clear() {
+            used = 0u;
+            in_message = false;
+            references.clear();
+            referenced = referenced_at = 0u;
+        }
+
+        /// Send all of the messages in the buffer in a single write and then
+        /// clear it. Returns the number of bytes sent.
+        template<typename S, typename Y>
+        std::size_t send(S &socket, Y yield) {
+            finish();
+            const auto bytes = size();
+            if ( references.size() ) {
+                std::vector<boost::asio::const_buffer> parts;
+                parts.reserve(2 * references.size() + 1);
+                std::size_t from{};
+                for ( const auto &r : references ) {
+                    if ( r.first > from ) {
+                        parts.emplace_back(buffer.data() + from, r.first - from);
+                    }
+                    parts.emplace_back(r.second.data(), r.second.size());
+                    from = r.first;
+                }
+                if ( used > from ) parts.emplace_back(buffer.data() + from, used - from);
+                async_write(socket, parts, yield);
+            } else if ( bytes ) {
+                async_write(socket, boost::asio::buffer(buffer.data(), bytes), yield);
+            }
+            clear();
+            return bytes;
+        }
+    };
+
+
+    /// Helper to assemble a single command message to be sent to Postgres.
+    /// Use a `command_buffer` to send more than one message in one go.
     class command {
         char instruction;
-        boost::asio::streambuf body;
+        command_buffer body;
     public:
         /// Construct a command. The very first message sent after connecting
         /// doesn't have an instruction value. Send zero for this case. The
         /// `handshake` function will handle this for you.
         command(char type)
-        : instruction(type) {
+        : instruction(type), body(256) {
+            body.message(type);
         }
 
         /// Add the specified bytes to the body
         template<typename B, typename = std::enable_if_t<std::is_integral<B>::value>>
         void bytes(array_view<B> av) {
-            static_assert(sizeof(B) == 1, "Must add an array of bytes");
-            body.sputn(av.data(), av.size());
+            body.bytes(av);
+        }
+
+        /// Add the bytes to the body without copying them. They must stay
+        /// valid until the command has been sent.
+        void reference(byte_view av) {
+            body.reference(av);
         }
 
         /// Add a single byte to the body
         template<typename B, typename = std::enable_if_t<std::is_integral<B>::value>>
         void byte(B b) {
-            static_assert(sizeof(B) == 1, "Must add a single byte");
-            body.sputc(b);
+            body.byte(b);
         }
 
         /// Write an in8
         void int8(int8_t c) {
-            byte(c);
+            body.int8(c);
         }
         /// Write an int16
         void int16(int16_t i) {
-            int8((i & 0xff00) >> 8);
-            int8(i & 0x00ff);
+            body.int16(i);
         }
         /// Write an int32
         void int32(int32_t i) {
-            int8((i & 0xff00'0000) >> 24);
-            int8((i & 0x00ff'0000) >> 16);
-            int8((i & 0x0000'ff00) >> 8);
-            int8(i & 0x0000'00ff);
+            body.int32(i);
         }
 
         /// Send a C string, including the terminating NIL character
         void c_str(const char *s) {
-            while (*s) {
-                byte(*s++);
-            }
-            int8(0);
+            body.c_str(s);
         }
 
 
         /// Send the current command to Postgres. Return the body size sent
         template<typename S, typename Y>
         std::size_t send(S &socket, Y yield) {
-            const std::size_t bytes = body.size() + 4;
-            std::array<unsigned char, 5> h5;
-            std::array<unsigned char, 4> h4;
-            raw_memory header;
-            std::size_t offset;
-            if ( instruction ) {
-                header = h5;
-                header[0] = instruction;
-                offset = 1;
-            } else {
-                header = h4;
-                offset = 0;
-            }
-            header[offset + 0] = (bytes & 0xff00'0000) >> 24;
-            header[offset + 1] = (bytes & 0x00ff'0000) >> 16;
-            header[offset + 2] = (bytes & 0x0000'ff00) >> 8;
-            header[offset + 3] = (bytes & 0x0000'00ff);
-            std::array<boost::asio::streambuf::const_buffers_type, 2>
-                data{{boost::asio::streambuf::const_buffers_type(header.data(), header.size()),
-                    body.data()}};
-            async_write(socket, data, yield);
-            return body.size();
+            return body.send(socket, yield) - (instruction ? 5u : 4u);
         }
     };
 
@@ -0,0 +1,238 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/query.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <array>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+
+namespace pgasio {
+
+
+    /// Return the text of the first field of the first row of the results.
+    /// All of the other data returned is read and discarded.
+    template<typename S, typename Y> inline
+    std::string first_value(resultset<S> results, Y yield) {
+        std::optional<std::string> value;
+        while ( auto rs = results.recordset(yield) ) {
+            while ( auto block = rs.next_block(yield) ) {
+                if ( not value && block.fields().size() && block.fields()[0].data() ) {
+                    const auto field = block.fields()[0];
+                    value.emplace(field.data(), field.data() + field.size());
+                }
+            }
+        }
+        return value.value_or(std::string{});
+    }
+    /// Execute the SQL and return the text of the first field of the first
+    /// row
+    template<typename S, typename Y> inline
+    std::string first_value(connection<S> &cnx, const std::string &sql, Y yield) {
+        return first_value(query(cnx, sql, yield), yield);
+    }
+    /// Execute the SQL with text parameters and return the text of the
+    /// first field of the first row
+    template<typename S, typename Y> inline
+    std::string first_value(
+        connection<S> &cnx, const std::string &sql,
+        array_view<const byte_view> parameters, Y yield
+    ) {
+        return first_value(query(cnx, sql, parameters, yield), yield);
+    }
+
+
+    /// Replace `{partition}` and `{partitions}` in the query template with
+    /// the partition number and partition count.
+    inline std::string partition_sql(
+        std::string sql, std::size_t partition, std::size_t partitions
+    ) {
+        auto replace = [&sql](const std::string &marker, const std::string &value) {
+            for ( auto pos = sql.find(marker); pos != std::string::npos;
+                    pos = sql.find(marker, pos + value.size()) ) {
+                sql.replace(pos, marker.size(), value);
+            }
+        };
+        replace("{partitions}", std::to_string(partitions));
+        replace("{partition}", std::to_string(partition));
+        return sql;
+    }
+
+
+    /// Return SQL that scans one of `partitions` ranges of table pages using
+    /// `ctid` ranges. The final range is open ended so that rows on pages
+    /// added after the page count was taken are still returned.
+    ///
+    /// The `table` is put into the SQL exactly as it is given, so it must
+    /// already be a correctly quoted (and possibly schema qualified) name,
+    /// such as the one Postgres returns for `'name'::regclass::text`.
+    inline std::string ctid_range_sql(
+        const std::string &table, std::size_t pages,
+        std::size_t partition, std::size_t partitions
+    ) {
+        const auto per = (pages + partitions - 1) / partitions;
+        std::string sql = "SELECT * FROM " + table +
+            " WHERE ctid >= '(" + std::to_string(partition * per) + ",0)'::tid";
+        if ( partition + 1 < partitions ) {
+            sql += " AND ctid < '(" + std::to_string((partition + 1) * per) + ",0)'::tid";
+        }
+        return sql;
+    }
+
+
+    /// Scan data over `partitions` connections at the same time. For each
+    /// partition a connection is opened by calling `connect(yield)` and the
+    /// SQL from `sql(partition)` is executed on it. Each block of data is
+    /// passed to `block(partition, columns, record_block, yield)` as it
+    /// arrives.
+    ///
+    /// When `snapshot` is true a coordinating connection exports its
+    /// snapshot and every partition imports it, so that all partitions see
+    /// the same consistent view of the database.
+    ///
+    /// The work is spawned on the `io_service` and the scan happens as the
+    /// `io_service` is run. Run it from as many threads as there are cores
+    /// for the extraction to scale across them. Calls to `block` for the
+    /// same partition are never concurrent, but calls for different
+    /// partitions will be if more than one thread is used. The first
+    /// exception thrown by any partition is re-thrown from `io_service::run`
+    /// once all of the partitions have finished.
+    template<typename C, typename Q, typename B> inline
+    void partitioned_scan(
+        boost::asio::io_service &ios, std::size_t partitions,
+        C connect, Q sql, B block, bool snapshot = true
+    ) {
+        struct state {
+            boost::asio::io_service::strand strand;
+            boost::asio::steady_timer finished;
+            std::atomic<std::size_t> running;
+            std::mutex mutex;
+            std::exception_ptr error;
+
+            state(boost::asio::io_service &ios, std::size_t p)
+            : strand{ios}, finished{ios}, running{p} {
+            }
+        };
+        auto scan = std::make_shared<state>(ios, partitions);
+        boost::asio::spawn(scan->strand, [=, &ios](auto yield) {
+            using cnx_type = decltype(connect(yield));
+            std::optional<cnx_type> coordinator;
+            std::string snapshot_id;
+            if ( snapshot ) {
+                coordinator.emplace(connect(yield));
+                first_value(*coordinator,
+                    "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY", yield);
+                snapshot_id = first_value(*coordinator, "SELECT pg_export_snapshot()", yield);
+            }
+            for ( std::size_t partition{}; partition < partitions; ++partition ) {
+                boost::asio::spawn(ios, [=](auto yield) {
+                    try {
+                        auto cnx = connect(yield);
+                        if ( snapshot ) {
+                            first_value(cnx, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY; "
+                                "SET TRANSACTION SNAPSHOT '" + snapshot_id + "'", yield);
+                        }
+                        auto results = query(cnx, sql(partition), yield);
+                        while ( auto rs = results.recordset(yield) ) {
+                            while ( auto data = rs.next_block(yield) ) {
+                                block(partition, rs.columns(), std::move(data), yield);
+                            }
+                        }
+                        if ( snapshot ) first_value(cnx, "COMMIT", yield);
+                    } catch ( ... ) {
+                        std::unique_lock<std::mutex> lock{scan->mutex};
+                        if ( not scan->error ) scan->error = std::current_exception();
+                    }
+                    if ( --scan->running == 0 ) {
+                        scan->strand.post([scan]() { scan->finished.cancel(); });
+                    }
+                });
+            }
+            /// The exported snapshot is only valid while the coordinating
+            /// transaction is open, so wait for all partitions to finish.
+            while ( scan->running ) {
+                scan->finished.expires_at(boost::asio::steady_timer::time_point::max());
+                boost::system::error_code ignored;
+                scan->finished.async_wait(yield[ignored]);
+            }
+            if ( coordinator ) first_value(*coordinator, "COMMIT", yield);
+            std::unique_lock<std::mutex> lock{scan->mutex};
+            if ( scan->error ) std::rethrow_exception(scan->error);
+        });
+    }
+
+
+    /// Scan a whole table over `partitions` connections by splitting its
+    /// pages into `ctid` ranges. The block callback is the same as for
+    /// `partitioned_scan`.
+    ///
+    /// The `table` is a name in the form Postgres accepts for a `regclass`,
+    /// i.e. as it would be written in SQL: `orders`, `sales.orders` or
+    /// `"Mixed Case"`. It is sent as a parameter and the quoted name that
+    /// Postgres gives back is what the partitions' SQL uses, so it can't
+    /// change the meaning of the queries.
+    template<typename C, typename B> inline
+    void partitioned_table_scan(
+        boost::asio::io_service &ios, const std::string &table,
+        std::size_t partitions, C connect, B block, bool snapshot = true
+    ) {
+        boost::asio::spawn(ios, [=, &ios](auto yield) {
+            std::size_t pages{};
+            std::string name;
+            {
+                auto cnx = connect(yield);
+                std::array<byte_view, 1> parameters{{
+                    byte_view{reinterpret_cast<const unsigned char *>(table.data()), table.size()}}};
+                name = first_value(cnx, "SELECT $1::regclass::text", parameters, yield);
+                pages = std::stoull(first_value(cnx,
+                    "SELECT pg_relation_size($1::regclass)"
+                        " / current_setting('block_size')::int8", parameters, yield));
+            }
+            partitioned_scan(ios, partitions, connect,
+                [=](std::size_t partition) {
+                    return ctid_range_sql(name, pages, partition, partitions);
+                },
+                block, snapshot);
+        });
+    }
+
+
+    /// Run the `io_service` on `threads` threads (including the calling one)
+    /// until all of the work on it is done. If any of the threads exits with
+    /// an exception the `io_service` is stopped and the exception re-thrown
+    /// once all threads have finished.
+    inline void run_threads(boost::asio::io_service &ios, std::size_t threads) {
+        std::mutex mutex;
+        std::exception_ptr error;
+        auto run = [&]() {
+            try {
+                ios.run();
+            } catch ( ... ) {
+                std::unique_lock<std::mutex> lock{mutex};
+                if ( not error ) error = std::current_exception();
+                ios.stop();
+            }
+        };
+        std::vector<std::thread> pool;
+        for ( std::size_t t{1}; t < threads; ++t ) pool.emplace_back(run);
+        run();
+        for ( auto &t : pool ) t.join();
+        if ( error ) std::rethrow_exception(error);
+    }
+
+
+}
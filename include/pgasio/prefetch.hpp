@@ -0,0 +1,115 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/channel.hpp>
+#include <pgasio/query.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/strand.hpp>
+
+
+namespace pgasio {
+
+
+    /// Reads the blocks of a recordset ahead of the consumer. A separate
+    /// coroutine reads from the connection and queues up to `depth` blocks,
+    /// so Postgres is kept sending whilst the consumer works on a block.
+    ///
+    /// The reading coroutine is spawned on its own strand of the
+    /// `io_service`. When the `io_service` is run by more than one thread the
+    /// network reads happen at the same time as the consumer's processing.
+    /// With a single thread the blocks are still read whenever the consumer
+    /// is suspended.
+    ///
+    /// The connection must not be used for anything else until `next_block`
+    /// has returned an empty block. The recordset must outlive the reading,
+    /// which also means that the prefetched recordset should be read to the
+    /// end, just like a normal one. If it is destroyed before then the
+    /// reading coroutine stops after its current block, leaving unread rows
+    /// on the connection.
+    template<typename S>
+    class prefetched_recordset {
+        struct state {
+            channel<record_block> blocks;
+            std::mutex mutex;
+            std::exception_ptr error;
+
+            state(std::size_t depth)
+            : blocks{depth} {
+            }
+        };
+        std::shared_ptr<state> work;
+        array_view<const column_meta> m_columns;
+
+    public:
+        /// Start reading ahead. A `depth` of zero is treated as one
+        prefetched_recordset(
+            boost::asio::io_service &ios, recordset<S> &rs, std::size_t depth = 2
+        ) : work{std::make_shared<state>(std::max(depth, std::size_t{1}))},
+            m_columns{rs.columns()}
+        {
+            boost::asio::spawn(boost::asio::make_strand(ios), [work = work, &rs](auto yield) {
+                try {
+                    /// Each block counts as one against the channel's
+                    /// budget, so it holds at most `depth` blocks
+                    while ( auto block = rs.next_block(yield) ) {
+                        work->blocks.produce(std::move(block), 1u, yield);
+                    }
+                } catch ( ... ) {
+                    std::unique_lock<std::mutex> lock{work->mutex};
+                    work->error = std::current_exception();
+                }
+                work->blocks.close();
+            });
+        }
+
+        /// Not copyable
+        prefetched_recordset(const prefetched_recordset &) = delete;
+        prefetched_recordset &operator = (const prefetched_recordset &) = delete;
+        /// Movable
+        prefetched_recordset(prefetched_recordset &&) = default;
+
+        ~prefetched_recordset() {
+            if ( work ) work->blocks.close();
+        }
+
+        /// The column meta data for the recordset
+        array_view<const column_meta> columns() const {
+            return m_columns;
+        }
+
+        /// Return the next block, waiting for it to arrive if it hasn't yet.
+        /// An empty block is returned at the end of the data. Any exception
+        /// thrown whilst reading, e.g. a `postgres_error`, is thrown from
+        /// here after the blocks that came before it have been returned.
+        template<typename Y>
+        record_block next_block(Y yield) {
+            if ( auto block = work->blocks.consume(yield) ) return std::move(*block);
+            std::unique_lock<std::mutex> lock{work->mutex};
+            if ( work->error ) {
+                auto error = work->error;
+                work->error = nullptr;
+                std::rethrow_exception(error);
+            }
+            return record_block{};
+        }
+    };
+
+
+    /// Start reading the recordset ahead of the consumer, keeping up to
+    /// `depth` blocks queued
+    template<typename S> inline
+    prefetched_recordset<S> prefetch(
+        boost::asio::io_service &ios, recordset<S> &rs, std::size_t depth = 2
+    ) {
+        return prefetched_recordset<S>{ios, rs, depth};
+    }
+
+
+}
@@ -9,6 +9,9 @@
 #include <pgasio/connection.hpp>
 #include <pgasio/record_block.hpp>
 
+#include <limits>
+#include <optional>
+
 
 namespace pgasio {
 
@@ -25,13 +28,62 @@ namespace pgasio {
     };
 
 
+    /// Decode the body of a _RowDescription_ (`T`) message
+    inline std::vector<column_meta> row_description(decoder description) {
+        std::vector<column_meta> columns;
+        const std::size_t count = description.read_int16();
+        columns.reserve(count);
+        while ( columns.size() != count ) {
+            column_meta col;
+            col.name = description.read_string();
+            col.table_oid = description.read_int32();
+            col.table_column = description.read_int16();
+            col.field_type_oid = description.read_int32();
+            col.data_size = description.read_int16();
+            col.type_modifier = description.read_int32();
+            col.format_code = description.read_int16();
+            columns.push_back(col);
+        }
+        return columns;
+    }
+
+
     /// A wrapper around the basic block delivery mechanism
     template<typename S>
     class recordset {
         connection<S> &cnx;
-        std::vector<column_meta> cols;
+        std::shared_ptr<const std::vector<column_meta>> cols;
         std::size_t next_row_data_size;
         bool sentinel;
+
+        template<typename B, typename Y>
+        B fill(B block, Y yield) {
+            return recover(cnx, [&]() {
+                const auto bytes = next_row_data_size;
+                /// After an error there are no more rows to come
+                next_row_data_size = 0u;
+                next_row_data_size = block.read_rows(cnx.socket, bytes, yield);
+                return std::move(block);
+            }, yield);
+        }
+        /// Fill the block without throwing for server errors. After an
+        /// error the rest of the reply is skipped and an empty block returned
+        template<typename B, typename Y>
+        B fill(B block, boost::system::error_code &ec, Y yield) {
+            ec = {};
+            cnx.error.clear();
+            return capture(ec, [&]() {
+                const auto bytes = next_row_data_size;
+                next_row_data_size = 0u;
+                next_row_data_size = block.read_rows(cnx.socket, bytes, &cnx.error, yield);
+                if ( cnx.error ) {
+                    synchronise(cnx, yield);
+                    ec = cnx.error.code();
+                    return B{};
+                }
+                return std::move(block);
+            }, []() { return B{}; });
+        }
     public:
         /// Return a sentinel recordset that shows the resultset is done
         template<typename Y>
@@ -42,27 +94,21 @@ namespace pgasio {
         /// Return a rea; recordset that may contains data
         template<typename Y>
         recordset(connection<S> &cnx, header c, Y yield)
+        : recordset(cnx, c, nullptr, yield) {
+        }
+        /// As above, but if Postgres sends an error before the first row it
+        /// is stored in `failed`, if given, rather than thrown
+        template<typename Y>
+        recordset(connection<S> &cnx, header c, error_response *failed, Y yield)
         : cnx(cnx),
             cols([&]() {
-                std::vector<column_meta> columns;
-                auto body = c.message_body(cnx.socket, yield);
-                decoder description(body);
+                auto body = c.message_body(cnx.socket, cnx.memory, yield);
                 if ( c.type == 'T' ) {
-                    const std::size_t count = description.read_int16();
-                    columns.reserve(count);
-                    while ( columns.size() != count ) {
-                        column_meta col;
-                        col.name = description.read_string();
-                        col.table_oid = description.read_int32();
-                        col.table_column = description.read_int16();
-                        col.field_type_oid = description.read_int32();
-                        col.data_size = description.read_int16();
-                        col.type_modifier = description.read_int32();
-                        col.format_code = description.read_int16();
-                        columns.push_back(col);
-                    }
+                    return std::make_shared<const std::vector<column_meta>>(
+                        row_description(body));
+                } else {
+                    return std::make_shared<const std::vector<column_meta>>();
                 }
-                return columns;
             }()),
             next_row_data_size{},
             sentinel{false}
@@ -73,10 +119,13 @@ namespace pgasio {
             /// happens, for example, when an empty SQL statement is presented
             /// to the database.
             while ( c.type == 'T' && cnx.socket.is_open() ) {
-                auto header = message_header(cnx.socket, yield);
+                auto header = message_header(cnx.socket, failed, yield);
                 switch ( header.type ) {
                 case 'C':
-                    header.message_body(cnx.socket, yield);
+                    header.message_body(cnx.socket, cnx.memory, yield);
+                    next_row_data_size = 0u;
+                    return;
+                case 'E':
                     next_row_data_size = 0u;
                     return;
                 case 'D':
@@ -94,9 +143,39 @@ namespace pgasio {
             }
         }
 
+        /// Return a recordset for the execution of a prepared statement
+        /// whose columns are already known. The header is for the first
+        /// message after the statement is bound, either a data row or the
+        /// command completion.
+        template<typename Y>
+        recordset(
+            connection<S> &cnx, std::shared_ptr<const std::vector<column_meta>> columns,
+            header c, Y yield
+        ) : cnx(cnx), cols(std::move(columns)), next_row_data_size{}, sentinel{false} {
+            if ( c.type == 'D' ) {
+                next_row_data_size = c.body_size;
+            } else {
+                c.message_body(cnx.socket, cnx.memory, yield);
+            }
+        }
+
+        /// The types loaded for the connection by `load_types`, if any
+        const std::shared_ptr<const type_registry> &types() const {
+            return cnx.types;
+        }
+
+        /// The memory resource blocks are allocated from
+        std::pmr::memory_resource *memory() const {
+            return cnx.memory;
+        }
+
         /// The column meta data for this recordset.
         array_view<const column_meta> columns() const {
-            return cols;
+            if ( cols ) {
+                return *cols;
+            } else {
+                return {};
+            }
         }
 
         /// Returns true if the recordset is one that contains data, i.e. not
@@ -105,17 +184,78 @@ namespace pgasio {
             return not sentinel;
         }
 
-        /// Returns the next data block
+        /// Returns the next data block. If Postgres reports an error part
+        /// way through the rows then the rest of the reply is skipped before
+        /// the `postgres_error` is thrown.
         template<typename Y>
         pgasio::record_block next_block(Y yield) {
             if ( next_row_data_size ) {
-                pgasio::record_block block{cols.size()};
-                next_row_data_size = block.read_rows(cnx.socket, next_row_data_size, yield);
-                return block;
+                pgasio::record_block block{cols->size(), cnx.memory};
+                return fill(std::move(block), yield);
+            } else {
+                return pgasio::record_block{};
+            }
+        }
+        /// Returns the next data block, storing the rows in the slab
+        template<typename Y>
+        pgasio::record_block next_block(unaligned_slab slab, Y yield) {
+            if ( next_row_data_size ) {
+                pgasio::record_block block{cols->size(), std::move(slab)};
+                return fill(std::move(block), yield);
+            } else {
+                return pgasio::record_block{};
+            }
+        }
+
+        /// Returns the next data block. If Postgres reports an error then
+        /// `ec` is set to its SQLSTATE (the full error is in the
+        /// connection's `error`), the rest of the reply is skipped and an
+        /// empty block is returned. A network or protocol failure also sets
+        /// `ec`, after which the connection can't be used.
+        template<typename Y>
+        pgasio::record_block next_block(boost::system::error_code &ec, Y yield) {
+            if ( next_row_data_size ) {
+                pgasio::record_block block{cols->size(), cnx.memory};
+                return fill(std::move(block), ec, yield);
+            } else {
+                ec = {};
+                return pgasio::record_block{};
+            }
+        }
+        template<typename Y>
+        pgasio::record_block next_block(
+            unaligned_slab slab, boost::system::error_code &ec, Y yield
+        ) {
+            if ( next_row_data_size ) {
+                pgasio::record_block block{cols->size(), std::move(slab)};
+                return fill(std::move(block), ec, yield);
             } else {
+                ec = {};
                 return pgasio::record_block{};
             }
         }
+
+        /// Fill a block of some other kind, e.g. a `typed_block`, with the
+        /// next rows. The block must have a `read_rows` member that works in
+        /// the same way as the one on `record_block`, and a default
+        /// constructed block is returned when there are no more rows.
+        template<typename B, typename Y>
+        B read_block(B block, Y yield) {
+            if ( next_row_data_size ) {
+                return fill(std::move(block), yield);
+            } else {
+                return B{};
+            }
+        }
+        template<typename B, typename Y>
+        B read_block(B block, boost::system::error_code &ec, Y yield) {
+            if ( next_row_data_size ) {
+                return fill(std::move(block), ec, yield);
+            } else {
+                ec = {};
+                return B{};
+            }
+        }
     };
 
 
@@ -123,21 +263,116 @@ namespace pgasio {
     template<typename S>
     class resultset {
         connection<S> &cnx;
+        /// The columns for a prepared statement whose rows are still to come
+        std::shared_ptr<const std::vector<column_meta>> described;
+        /// The SQL and name of a statement being prepared for the cache
+        std::optional<std::pair<std::string, std::string>> preparing;
+
+        void prepared(std::shared_ptr<const std::vector<column_meta>> columns) {
+            described = columns;
+            if ( preparing ) {
+                cnx.statements.insert(std::move(preparing->first),
+                    statement_cache::statement{std::move(preparing->second), std::move(columns)});
+                preparing.reset();
+            }
+        }
+
     public:
         resultset(connection<S> &cnx)
         : cnx(cnx) {
         }
+        /// The results of executing a prepared statement whose columns are
+        /// already known
+        resultset(connection<S> &cnx, std::shared_ptr<const std::vector<column_meta>> columns)
+        : cnx(cnx), described(std::move(columns)) {
+        }
+        /// The results of preparing and executing a statement that is to
+        /// be put into the connection's statement cache
+        resultset(connection<S> &cnx, std::string sql, std::string name)
+        : cnx(cnx), preparing(std::make_pair(std::move(sql), std::move(name))) {
+        }
 
-        template<typename  Y>
+        /// Return the next recordset. A sentinel recordset is returned once
+        /// all of the results have been read. If Postgres reports an error
+        /// then the rest of the reply is skipped before the `postgres_error`
+        /// is thrown, so the connection can carry on being used.
+        template<typename Y>
         pgasio::recordset<S> recordset(Y yield) {
+            return recover(cnx, [&]() { return next(nullptr, yield); }, yield);
+        }
+
+        /// Return the next recordset. If Postgres reports an error then `ec`
+        /// is set to its SQLSTATE (the full error is in the connection's
+        /// `error`), the rest of the reply is skipped and a sentinel
+        /// recordset is returned. A network or protocol failure also sets
+        /// `ec`, after which the connection can't be used.
+        template<typename Y>
+        pgasio::recordset<S> recordset(boost::system::error_code &ec, Y yield) {
+            ec = {};
+            cnx.error.clear();
+            return capture(ec, [&]() {
+                auto rs = next(&cnx.error, yield);
+                if ( cnx.error ) ec = cnx.error.code();
+                return rs;
+            }, [&]() { return pgasio::recordset<S>(cnx, yield); });
+        }
+
+    private:
+        /// Errors are stored in `failed` if it is given, in which case the
+        /// rest of the reply is skipped and the sentinel returned
+        template<typename Y>
+        pgasio::recordset<S> next(error_response *failed, Y yield) {
             while ( cnx.socket.is_open() ) {
-                auto header = message_header(cnx.socket, yield);
+                auto header = message_header(cnx.socket, failed, yield);
                 switch ( header.type ) {
                 case 'I':
-                case 'T':
+                    described.reset();
                     return pgasio::recordset<S>{cnx, header, yield};
-                case 'Z':
-                    header.message_body(cnx.socket, yield);
+                case 'T':
+                    if ( preparing ) {
+                        prepared(std::make_shared<const std::vector<column_meta>>(
+                            row_description(header.message_body(cnx.socket, cnx.memory, yield))));
+                        break;
+                    } else {
+                        pgasio::recordset<S> rs{cnx, header, failed, yield};
+                        if ( failed && *failed ) {
+                            synchronise(cnx, yield);
+                            return pgasio::recordset<S>(cnx, yield);
+                        }
+                        return rs;
+                    }
+                case 'n': // NoData -- the prepared statement returns no rows
+                    header.message_body(cnx.socket, cnx.memory, yield);
+                    prepared(std::make_shared<const std::vector<column_meta>>());
+                    break;
+                case 'D':
+                    if ( described ) {
+                        return pgasio::recordset<S>{cnx, std::move(described), header, yield};
+                    } else {
+                        throw std::runtime_error("Got a data row without a row description");
+                    }
+                case 'C': // Commands that don't return any rows
+                    if ( described && described->size() ) {
+                        return pgasio::recordset<S>{cnx, std::move(described), header, yield};
+                    }
+                    described.reset();
+                    [[fallthrough]];
+                case '1': // ParseComplete
+                case '2': // BindComplete
+                case '3': // CloseComplete
+                case 't': // ParameterDescription
+                case 'A': // Notifications, see `result_cache::listen`
+                case 'N': // Notices
+                case 'S': // Parameter status changes
+                    header.message_body(cnx.socket, cnx.memory, yield);
+                    break;
+                case 'Z': {
+                        const auto body = header.message_body(cnx.socket, cnx.memory, yield);
+                        cnx.transaction_status = decoder{byte_view{body}}.read_byte();
+                    }
+                    return pgasio::recordset<S>(cnx, yield);
+                case 'E':
+                    synchronise(cnx, yield);
                     return pgasio::recordset<S>(cnx, yield);
                 default:
                     throw std::runtime_error(
@@ -150,18 +385,198 @@ namespace pgasio {
     };
 
 
+    /// Queue a _Close_ message for every statement evicted from the
+    /// connection's statement cache
+    template<typename S>
+    inline void queue_evictions(connection<S> &cnx) {
+        for ( const auto &name : cnx.statements.evicted() ) {
+            cnx.commands.message('C').byte('S').c_str(name);
+        }
+    }
+
+
+    /// Queue the _Bind_, _Execute_ and _Sync_ messages needed to run a
+    /// prepared statement that has no parameters, asking for text results
+    template<typename S>
+    inline void queue_execute(connection<S> &cnx, const std::string &name) {
+        cnx.commands.message('B').int8(0).c_str(name).int16(0).int16(0).int16(0);
+        cnx.commands.message('E').int8(0).int32(0);
+        cnx.commands.message('S');
+    }
+
+
+    /// Queue an SQL command in the connection's command buffer without
+    /// sending it. Any number of commands can be queued, then sent together
+    /// by calling `flush`. The results must be read in the same order that
+    /// the commands were queued.
+    ///
+    /// If the connection's statement cache has been given a capacity then
+    /// the SQL is prepared the first time it is seen and then re-used. The
+    /// SQL must then be a single statement. Statements evicted from the
+    /// cache are closed even if it has since been turned off.
+    template<typename S>
+    inline resultset<S> queue_query(connection<S> &cnx, const char *sql) {
+        queue_evictions(cnx);
+        if ( cnx.statements.capacity() ) {
+            if ( auto statement = cnx.statements.find(sql) ) {
+                queue_execute(cnx, statement->name);
+                return resultset<S>{cnx, statement->columns};
+            } else {
+                auto name = cnx.statements.next_name();
+                cnx.commands.message('P').c_str(name).c_str(sql).int16(0);
+                cnx.commands.message('D').byte('S').c_str(name);
+                queue_execute(cnx, name);
+                return resultset<S>{cnx, sql, std::move(name)};
+            }
+        } else {
+            cnx.commands.message('Q').c_str(sql);
+            return resultset<S>{cnx};
+        }
+    }
+    template<typename S>
+    inline resultset<S> queue_query(connection<S> &cnx, const std::string &sql) {
+        return queue_query(cnx, sql.c_str());
+    }
+
+    /// Queue an SQL statement with parameters (`$1`, `$2` etc.) using the
+    /// extended query protocol. A parameter whose `data()` is null is sent
+    /// as `NULL`. The parameter values are all in text format or all in
+    /// binary format, depending on `binary`, and the same goes for the
+    /// results and `binary_results`.
+    ///
+    /// Large parameter values are not copied, they are sent from the
+    /// caller's memory when the commands are flushed, so they must stay
+    /// valid until then.
+    ///
+    /// Postgres works out the parameters' types from the SQL. Where it
+    /// can't, e.g. for `unnest($1)`, either cast them in the SQL or give
+    /// their type OIDs (such as `binary_type<T>::array_oid`) in `types`.
+    /// A zero type, or a parameter past the end of `types`, is left for
+    /// Postgres to work out.
+    template<typename S>
+    inline resultset<S> queue_query(
+        connection<S> &cnx, const char *sql,
+        array_view<const byte_view> parameters, array_view<const int32_t> types,
+        bool binary = false, bool binary_results = false
+    ) {
+        if ( parameters.size() > std::size_t(std::numeric_limits<int16_t>::max()) ) {
+            throw std::invalid_argument("Too many parameters for one statement");
+        }
+        if ( types.size() > parameters.size() ) {
+            throw std::invalid_argument("More parameter types than parameters");
+        }
+        queue_evictions(cnx);
+        cnx.commands.message('P').int8(0).c_str(sql).int16(types.size());
+        for ( const auto type : types ) cnx.commands.int32(type);
+        cnx.commands.message('B').int8(0).int8(0)
+            .int16(1).int16(binary ? 1 : 0)
+            .int16(parameters.size());
+        for ( const auto value : parameters ) {
+            if ( value.data() ) {
+                cnx.commands.int32(value.size()).reference(value);
+            } else {
+                cnx.commands.int32(-1);
+            }
+        }
+        cnx.commands.int16(1).int16(binary_results ? 1 : 0);
+        cnx.commands.message('D').byte('P').int8(0);
+        cnx.commands.message('E').int8(0).int32(0);
+        cnx.commands.message('S');
+        return resultset<S>{cnx};
+    }
+    template<typename S>
+    inline resultset<S> queue_query(
+        connection<S> &cnx, const std::string &sql,
+        array_view<const byte_view> parameters, array_view<const int32_t> types,
+        bool binary = false, bool binary_results = false
+    ) {
+        return queue_query(cnx, sql.c_str(), parameters, types, binary, binary_results);
+    }
+    template<typename S>
+    inline resultset<S> queue_query(
+        connection<S> &cnx, const char *sql,
+        array_view<const byte_view> parameters,
+        bool binary = false, bool binary_results = false
+    ) {
+        return queue_query(cnx, sql, parameters, array_view<const int32_t>{}, binary, binary_results);
+    }
+    template<typename S>
+    inline resultset<S> queue_query(
+        connection<S> &cnx, const std::string &sql,
+        array_view<const byte_view> parameters,
+        bool binary = false, bool binary_results = false
+    ) {
+        return queue_query(cnx, sql.c_str(), parameters, binary, binary_results);
+    }
+
+    /// Send all of the queued commands to Postgres in a single write
+    template<typename S, typename Y>
+    inline void flush(connection<S> &cnx, Y yield) {
+        cnx.commands.send(cnx.socket, yield);
+    }
+
+
     /// Execute an SQL command and return the results
     template<typename S, typename Y>
     inline resultset<S> query(connection<S> &cnx, const char *sql, Y yield) {
-        command query('Q');
-        query.c_str(sql);
-        query.send(cnx.socket, yield);
-        return resultset<S>{cnx};
+        auto results = queue_query(cnx, sql);
+        flush(cnx, yield);
+        return results;
     }
     template<typename S, typename Y>
     inline resultset<S> query(connection<S> &cnx, const std::string &sql, Y yield) {
         return query(cnx, sql.c_str(), yield);
     }
+    /// Execute an SQL statement with parameters and return the results
+    template<typename S, typename Y>
+    inline resultset<S> query(
+        connection<S> &cnx, const std::string &sql,
+        array_view<const byte_view> parameters, Y yield
+    ) {
+        auto results = queue_query(cnx, sql.c_str(), parameters);
+        flush(cnx, yield);
+        return results;
+    }
+    /// As above, giving the parameters' type OIDs
+    template<typename S, typename Y>
+    inline resultset<S> query(
+        connection<S> &cnx, const std::string &sql,
+        array_view<const byte_view> parameters, array_view<const int32_t> types, Y yield
+    ) {
+        auto results = queue_query(cnx, sql.c_str(), parameters, types);
+        flush(cnx, yield);
+        return results;
+    }
+
+    /// Execute an SQL command without throwing. A failure to send it sets
+    /// `ec`. Errors from Postgres are reported when the results are read
+    /// using the `recordset` and `next_block` members that take an
+    /// `error_code`.
+    template<typename S, typename Y>
+    inline resultset<S> query(
+        connection<S> &cnx, const char *sql, boost::system::error_code &ec, Y yield
+    ) {
+        auto results = queue_query(cnx, sql);
+        ec = {};
+        capture(ec, [&]() { flush(cnx, yield); }, []() {});
+        return results;
+    }
+    template<typename S, typename Y>
+    inline resultset<S> query(
+        connection<S> &cnx, const std::string &sql, boost::system::error_code &ec, Y yield
+    ) {
+        return query(cnx, sql.c_str(), ec, yield);
+    }
+    template<typename S, typename Y>
+    inline resultset<S> query(
+        connection<S> &cnx, const std::string &sql,
+        array_view<const byte_view> parameters, boost::system::error_code &ec, Y yield
+    ) {
+        auto results = queue_query(cnx, sql.c_str(), parameters);
+        ec = {};
+        capture(ec, [&]() { flush(cnx, yield); }, []() {});
+        return results;
+    }
 
 
 }
@@ -18,7 +18,7 @@ namespace pgasio {
     /// Store a block of data rows. The data buffer is non-aligned.
     class record_block {
         std::size_t m_columns;
-        std::vector<byte_view> m_fields;
+        std::pmr::vector<byte_view> m_fields;
         unaligned_slab m_buffer;
 
     public:
@@ -37,6 +37,33 @@ namespace pgasio {
             const auto expected_records = (bytes + record_size - 1) / record_size;
             m_fields.reserve(m_columns * expected_records);
         }
+        /// Both the row data and the field index use memory from the memory
+        /// resource, which must outlive the block
+        record_block(std::size_t column_count,
+            std::pmr::memory_resource *memory,
+            std::size_t record_size = 512,
+            std::size_t bytes = 4u << 20)
+        : m_columns(column_count), m_fields(memory), m_buffer(bytes, memory) {
+            const auto expected_records = (bytes + record_size - 1) / record_size;
+            m_fields.reserve(m_columns * expected_records);
+        }
+        /// The block uses the slab to hold the data row network messages,
+        /// e.g. a slab from a `slab_pool`.
+        record_block(std::size_t column_count, unaligned_slab slab,
+            std::size_t record_size = 512)
+        : m_columns(column_count), m_buffer(std::move(slab)) {
+            const auto bytes = m_buffer.remaining();
+            const auto expected_records = (bytes + record_size - 1) / record_size;
+            m_fields.reserve(m_columns * expected_records);
+        }
+        /// The block takes over row data that has already been indexed, e.g.
+        /// a block read back from a `spill_file`. The fields must point into
+        /// the memory that has been allocated from the slab.
+        record_block(std::size_t column_count, unaligned_slab slab,
+            std::pmr::vector<byte_view> fields)
+        : m_columns(column_count), m_fields(std::move(fields)), m_buffer(std::move(slab)) {
+            assert(m_columns == 0 || m_fields.size() % m_columns == 0);
+        }
 
         /// Not copyable
         record_block(const record_block &) = delete;
@@ -51,6 +78,11 @@ namespace pgasio {
             return m_columns > 0;
         }
 
+        /// The number of columns in each record
+        std::size_t columns() const {
+            return m_columns;
+        }
+
         /// The number of bytes for row data still available in this block
         std::size_t remaining() const {
             return m_buffer.remaining();
@@ -60,6 +92,13 @@ namespace pgasio {
             return m_buffer.allocated();
         }
 
+        /// The total amount of memory held by the block, including the slab
+        /// and the field index
+        std::size_t memory_size() const {
+            return m_buffer.allocated() + m_buffer.remaining() +
+                m_fields.capacity() * sizeof(byte_view);
+        }
+
         /// Read the next data message into the block
         template<typename S, typename Y>
         void read_data_row(S &socket, std::size_t bytes, Y yield) {
@@ -82,13 +121,23 @@ namespace pgasio {
         /// Fill the block with data. Return zero if there is no more data to come
         template<typename S, typename Y>
         std::size_t read_rows(S &socket, std::size_t bytes, Y yield) {
+            return read_rows(socket, bytes, nullptr, yield);
+        }
+        /// Fill the block with data. If Postgres reports an error then it is
+        /// stored in `failed` (if given) and zero is returned
+        template<typename S, typename Y>
+        std::size_t read_rows(
+            S &socket, std::size_t bytes, error_response *failed, Y yield
+        ) {
             do {
                 read_data_row(socket, bytes, yield);
-                auto next = message_header(socket, yield);
+                auto next = message_header(socket, failed, yield);
                 if ( next.type == 'D' ) {
                     bytes = next.body_size;
                 } else if ( next.type == 'C' ) {
-                    next.message_body(socket, yield);
+                    next.message_body(socket, m_fields.get_allocator().resource(), yield);
+                    return 0;
+                } else if ( next.type == 'E' ) {
                     return 0;
                 } else {
                     throw std::logic_error(std::string("Unknown message type: ") + next.type);
@@ -101,6 +150,10 @@ namespace pgasio {
         array_view<const byte_view> fields() const {
             return m_fields;
         }
+        /// The bodies of the data row messages the fields point into
+        byte_view data() const {
+            return m_buffer.allocated_memory();
+        }
     };
 
 
@@ -0,0 +1,495 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/connection.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <unordered_map>
+
+
+namespace pgasio {
+
+
+    /// Format a WAL location (LSN) the way Postgres does, e.g. `16/B374D848`
+    inline std::string lsn_string(int64_t lsn) {
+        char buffer[20];
+        std::snprintf(buffer, sizeof(buffer), "%X/%X",
+            unsigned(uint64_t(lsn) >> 32), unsigned(uint64_t(lsn) & 0xffff'ffffu));
+        return buffer;
+    }
+    /// Parse a WAL location written the way Postgres does
+    inline int64_t parse_lsn(const std::string &lsn) {
+        const auto slash = lsn.find('/');
+        if ( slash == std::string::npos ) {
+            throw std::invalid_argument("Not a WAL location: " + lsn);
+        }
+        return int64_t(std::stoull(lsn.substr(0, slash), nullptr, 16) << 32)
+            + int64_t(std::stoull(lsn.substr(slash + 1), nullptr, 16));
+    }
+
+    /// The time in microseconds since the Postgres epoch (midnight on the
+    /// 1st January 2000), which is how the replication protocol sends times
+    inline int64_t postgres_time(
+        std::chrono::system_clock::time_point when = std::chrono::system_clock::now()
+    ) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            when.time_since_epoch()).count() - 946'684'800'000'000;
+    }
+
+    /// The value used for a TOASTed column whose value hasn't changed. The
+    /// value isn't sent, so this is told apart from a `NULL` (which has no
+    /// data pointer) by its data pointer
+    inline byte_view unchanged_toast() {
+        static const unsigned char marker{};
+        return byte_view{&marker, std::size_t{}};
+    }
+
+
+    /// A column of a table whose changes are being replicated
+    struct relation_column {
+        /// True if the column is part of the replica identity key
+        bool key;
+        std::string name;
+        int32_t type_oid;
+        int32_t type_modifier;
+    };
+    /// A table whose changes are being replicated. This is described by a
+    /// pgoutput _Relation_ message before the first change to it is sent.
+    struct relation_meta {
+        int32_t oid;
+        std::string schema;
+        std::string name;
+        /// The `REPLICA IDENTITY` setting of the table
+        char replica_identity;
+        std::vector<relation_column> columns;
+    };
+
+
+    /// The position of the values for a row in a `replication_block`
+    struct value_range {
+        std::size_t first, count;
+    };
+
+
+    /// A logical replication message from the pgoutput plugin
+    struct change {
+        /// The pgoutput message type: `B` (begin), `C` (commit), `O`
+        /// (origin), `R` (relation), `Y` (type), `I` (insert), `U`
+        /// (update), `D` (delete), `T` (truncate) or `M` (message)
+        char type;
+        /// The WAL location of the data the message was sent in
+        int64_t lsn;
+        /// For begin and commit messages, the LSN of the commit record
+        int64_t commit_lsn;
+        /// For commit messages, the LSN just past the commit record. This
+        /// is the location to `acknowledge` once the transaction has been
+        /// dealt with
+        int64_t end_lsn;
+        /// For begin and commit messages, the commit time
+        int64_t timestamp;
+        /// For begin messages, the transaction ID
+        uint32_t xid;
+        /// For relation, insert, update and delete messages, the table OID
+        int32_t relation;
+        /// For updates and deletes, `K` if the old values are only the
+        /// replica identity key columns, `O` if they're the whole of the old
+        /// row, or zero if no old values were sent
+        char old_kind;
+        /// The old and new column values
+        value_range old_values, new_values;
+        /// The whole of the message apart from its type byte. The messages
+        /// without their own members can be decoded from this
+        byte_view body;
+    };
+
+
+    /// A block of logical replication messages. The messages are kept in a
+    /// slab and the changes, and their column values, are views into it, so
+    /// decoding the messages doesn't allocate for each change.
+    class replication_block {
+        template<typename S> friend class replication_stream;
+
+        unaligned_slab m_buffer;
+        std::vector<change> m_changes;
+        std::vector<byte_view> m_values;
+        bool m_live;
+
+        value_range tuple(decoder &message) {
+            const value_range range{m_values.size(), std::size_t(message.read_int16())};
+            for ( std::size_t column{}; column < range.count; ++column ) {
+                switch ( message.read_byte() ) {
+                case 'n':
+                    m_values.push_back(byte_view{});
+                    break;
+                case 'u':
+                    m_values.push_back(unchanged_toast());
+                    break;
+                case 't':
+                case 'b': {
+                        const auto bytes = message.read_int32();
+                        m_values.push_back(message.read_bytes(bytes));
+                    }
+                    break;
+                default:
+                    throw std::runtime_error("Unknown pgoutput column value kind");
+                }
+            }
+            return range;
+        }
+
+        /// Decode the pgoutput message that was sent in the WAL data at `lsn`
+        const change &decode(int64_t lsn, byte_view message) {
+            decoder msg{message};
+            change c{};
+            c.type = msg.read_byte();
+            c.lsn = lsn;
+            c.body = message.slice(1);
+            switch ( c.type ) {
+            case 'B':
+                c.commit_lsn = msg.read_int64();
+                c.timestamp = msg.read_int64();
+                c.xid = msg.read_int32();
+                break;
+            case 'C':
+                msg.read_byte(); // Flags
+                c.commit_lsn = msg.read_int64();
+                c.end_lsn = msg.read_int64();
+                c.timestamp = msg.read_int64();
+                break;
+            case 'R':
+                c.relation = msg.read_int32();
+                break;
+            case 'I':
+                c.relation = msg.read_int32();
+                msg.read_byte(); // 'N'
+                c.new_values = tuple(msg);
+                break;
+            case 'U': {
+                    c.relation = msg.read_int32();
+                    auto kind = msg.read_byte();
+                    if ( kind == 'K' || kind == 'O' ) {
+                        c.old_kind = kind;
+                        c.old_values = tuple(msg);
+                        kind = msg.read_byte();
+                    }
+                    c.new_values = tuple(msg);
+                }
+                break;
+            case 'D':
+                c.relation = msg.read_int32();
+                c.old_kind = msg.read_byte();
+                c.old_values = tuple(msg);
+                break;
+            }
+            m_changes.push_back(c);
+            return m_changes.back();
+        }
+
+    public:
+        /// An empty block shows that the stream has finished
+        replication_block()
+        : m_live{false} {
+        }
+        /// The block is initialised to hold the messages in the slab
+        explicit replication_block(unaligned_slab slab,
+            std::size_t message_size = 128) // Mean message size
+        : m_buffer(std::move(slab)), m_live{true} {
+            const auto expected = m_buffer.remaining() / message_size + 1;
+            m_changes.reserve(expected);
+            m_values.reserve(expected * 4);
+        }
+
+        /// Not copyable
+        replication_block(const replication_block &) = delete;
+        replication_block &operator = (const replication_block &) = delete;
+        /// Moveable
+        replication_block(replication_block &&) = default;
+        replication_block &operator = (replication_block &&) = default;
+
+        /// True unless this shows the end of the stream. A block that isn't
+        /// the end may still be empty
+        operator bool () const {
+            return m_live;
+        }
+
+        /// The changes in the block, in WAL order
+        array_view<const change> changes() const {
+            return m_changes;
+        }
+        /// The column values for a row. A `NULL` has no data pointer and an
+        /// unchanged TOAST value is `unchanged_toast()`
+        array_view<const byte_view> values(value_range range) const {
+            return array_view<const byte_view>{m_values.data() + range.first, range.count};
+        }
+
+        /// The total amount of memory held by the block
+        std::size_t memory_size() const {
+            return m_buffer.allocated() + m_buffer.remaining() +
+                m_changes.capacity() * sizeof(change) +
+                m_values.capacity() * sizeof(byte_view);
+        }
+    };
+
+
+    /// The number of bytes the socket has read but not yet transferred, for
+    /// sockets that buffer their reads
+    template<typename S> inline
+    auto buffered_bytes(const S &socket, int) -> decltype(std::size_t(socket.buffered())) {
+        return socket.buffered();
+    }
+    template<typename S> inline
+    std::size_t buffered_bytes(const S &, long) {
+        return 0u;
+    }
+
+
+    /// The stream of messages from a logical replication slot. Blocks are
+    /// returned at a transaction commit once all of the data that has
+    /// arrived has been read, or when the block is full.
+    ///
+    /// Standby status updates are sent when Postgres asks for one and at the
+    /// start of `next_block` once `status_interval` has passed since the
+    /// last. They report the WAL received, and the location given to
+    /// `acknowledge` as flushed and applied.
+    template<typename S>
+    class replication_stream {
+        connection<S> &cnx;
+        std::unordered_map<int32_t, relation_meta> m_relations;
+        std::size_t next_size;
+        int64_t m_received, m_acknowledged;
+        bool active, stopping;
+        std::chrono::steady_clock::time_point last_status;
+
+        void describe(byte_view body) {
+            decoder msg{body};
+            relation_meta meta;
+            meta.oid = msg.read_int32();
+            meta.schema = msg.read_string();
+            meta.name = msg.read_string();
+            meta.replica_identity = msg.read_byte();
+            const std::size_t count = msg.read_int16();
+            meta.columns.reserve(count);
+            while ( meta.columns.size() != count ) {
+                relation_column column;
+                column.key = msg.read_byte() & 1;
+                column.name = msg.read_string();
+                column.type_oid = msg.read_int32();
+                column.type_modifier = msg.read_int32();
+                meta.columns.push_back(std::move(column));
+            }
+            m_relations[meta.oid] = std::move(meta);
+        }
+
+        /// Fill the block. Returns false once the stream has ended.
+        template<typename Y>
+        bool read(replication_block &block, Y yield) {
+            while ( cnx.socket.is_open() ) {
+                std::size_t bytes = next_size;
+                next_size = 0u;
+                if ( not bytes ) {
+                    auto header = message_header(cnx.socket, yield);
+                    switch ( header.type ) {
+                    case 'd': // CopyData
+                        bytes = header.body_size;
+                        break;
+                    case 'c': // CopyDone -- Postgres has finished
+                        header.message_body(cnx.socket, yield);
+                        if ( not stopping ) {
+                            cnx.commands.message('c');
+                            cnx.commands.send(cnx.socket, yield);
+                        }
+                        synchronise(cnx, yield);
+                        return false;
+                    case 'N':
+                    case 'S':
+                        header.message_body(cnx.socket, yield);
+                        continue;
+                    default:
+                        throw std::runtime_error(
+                            "Replication wasn't expecting this message type: "
+                                + std::to_string(header.type) + "/" + header.type);
+                    }
+                }
+                if ( bytes > block.m_buffer.remaining() ) {
+                    if ( block.m_buffer.allocated() ) {
+                        next_size = bytes;
+                        return true;
+                    }
+                    block.m_buffer = unaligned_slab{bytes};
+                }
+                auto message = block.m_buffer.allocate(bytes);
+                transfer(cnx.socket, message, bytes, yield);
+                decoder copy{message};
+                switch ( copy.read_byte() ) {
+                case 'w': { // XLogData
+                        const auto start = copy.read_int64();
+                        copy.read_int64(); // The current end of the WAL
+                        copy.read_int64(); // Send time
+                        m_received = std::max(m_received, start);
+                        const auto &c = block.decode(start,
+                            byte_view{message.data(), message.size()}.slice(25));
+                        if ( c.type == 'R' ) describe(c.body);
+                        if ( c.type == 'C' && not buffered_bytes(cnx.socket, 0) ) return true;
+                    }
+                    break;
+                case 'k': { // Primary keepalive
+                        copy.read_int64(); // The current end of the WAL
+                        copy.read_int64(); // Send time
+                        if ( copy.read_byte() ) send_status(yield);
+                        if ( block.m_changes.size() && not buffered_bytes(cnx.socket, 0) ) {
+                            return true;
+                        }
+                    }
+                    break;
+                }
+            }
+            throw std::runtime_error("The Postgres connection closed during replication");
+        }
+
+    public:
+        /// How often a standby status update is sent if Postgres doesn't
+        /// ask for one
+        std::chrono::steady_clock::duration status_interval = std::chrono::seconds{10};
+
+        /// Wrap a connection that has had `START_REPLICATION` sent. Use
+        /// `start_replication` to create one of these.
+        explicit replication_stream(connection<S> &c)
+        : cnx(c), next_size{}, m_received{}, m_acknowledged{},
+            active{true}, stopping{false}, last_status{std::chrono::steady_clock::now()}
+        {
+        }
+
+        /// The table described by the most recent _Relation_ message for it
+        const relation_meta *relation(int32_t oid) const {
+            auto found = m_relations.find(oid);
+            if ( found == m_relations.end() ) {
+                return nullptr;
+            } else {
+                return &found->second;
+            }
+        }
+
+        /// The WAL location of the most recent data received
+        int64_t received() const {
+            return m_received;
+        }
+        /// Record that all changes up to the WAL location have been dealt
+        /// with, so Postgres can throw away the WAL before it. The location
+        /// is reported in the next standby status update.
+        void acknowledge(int64_t lsn) {
+            m_acknowledged = std::max(m_acknowledged, lsn);
+        }
+
+        /// Send a standby status update now
+        template<typename Y>
+        void send_status(Y yield, bool reply = false) {
+            cnx.commands.message('d').byte('r')
+                .int64(std::max(m_received, m_acknowledged))
+                .int64(m_acknowledged).int64(m_acknowledged)
+                .int64(postgres_time()).int8(reply);
+            cnx.commands.send(cnx.socket, yield);
+            last_status = std::chrono::steady_clock::now();
+        }
+
+        /// Ask Postgres to stop sending. Blocks must still be read until an
+        /// empty one is returned.
+        template<typename Y>
+        void stop(Y yield) {
+            if ( stopping ) return;
+            stopping = true;
+            cnx.commands.message('c');
+            cnx.commands.send(cnx.socket, yield);
+        }
+
+        /// Return the next block of messages. An empty block is returned once
+        /// the stream has ended.
+        template<typename Y>
+        replication_block next_block(Y yield) {
+            return next_block(unaligned_slab{4u << 20}, yield);
+        }
+        /// Return the next block of messages, storing them in the slab
+        template<typename Y>
+        replication_block next_block(unaligned_slab slab, Y yield) {
+            if ( not active ) return replication_block{};
+            if ( not stopping &&
+                    std::chrono::steady_clock::now() - last_status >= status_interval ) {
+                send_status(yield);
+            }
+            replication_block block{std::move(slab)};
+            /// If there is an error the stream has finished
+            active = false;
+            active = recover(cnx, [&]() { return read(block, yield); }, yield);
+            return block;
+        }
+    };
+
+
+    /// Connect to Postgres in logical replication mode
+    template<typename S, typename Y> inline
+    connection<S> replication_handshake(
+        S socket, const char *user, const char *database, Y yield
+    ) {
+        return handshake(std::move(socket), user, database,
+            startup_options{{"replication", "database"}}, yield);
+    }
+
+
+    /// Start streaming changes from the logical replication slot, which must
+    /// use the `pgoutput` plugin, for the comma separated publications. The
+    /// stream starts from the location given, or where the slot last
+    /// confirmed if this is zero.
+    template<typename S, typename Y> inline
+    replication_stream<S> start_replication(
+        connection<S> &cnx, const std::string &slot, const std::string &publications,
+        int64_t start, Y yield
+    ) {
+        std::string sql = "START_REPLICATION SLOT \"";
+        for ( auto c : slot ) {
+            if ( c == '"' ) sql += '"';
+            sql += c;
+        }
+        sql += "\" LOGICAL " + lsn_string(start) +
+            " (proto_version '1', publication_names '";
+        for ( auto c : publications ) {
+            if ( c == '\'' ) sql += '\'';
+            sql += c;
+        }
+        sql += "')";
+        cnx.commands.message('Q').c_str(sql);
+        cnx.commands.send(cnx.socket, yield);
+        recover(cnx, [&]() {
+            while ( cnx.socket.is_open() ) {
+                auto header = message_header(cnx.socket, yield);
+                header.message_body(cnx.socket, yield);
+                switch ( header.type ) {
+                case 'W': // CopyBothResponse
+                    return;
+                case 'N':
+                case 'S':
+                    break;
+                default:
+                    throw std::runtime_error(
+                        "START_REPLICATION wasn't expecting this message type: "
+                            + std::to_string(header.type) + "/" + header.type);
+                }
+            }
+            throw std::runtime_error("The Postgres connection closed starting replication");
+        }, yield);
+        return replication_stream<S>{cnx};
+    }
+    template<typename S, typename Y> inline
+    replication_stream<S> start_replication(
+        connection<S> &cnx, const std::string &slot, const std::string &publications,
+        Y yield
+    ) {
+        return start_replication(cnx, slot, publications, 0, yield);
+    }
+
+
+}
@@ -0,0 +1,404 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/query.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+
+namespace pgasio {
+
+
+    /// What the router currently knows about one of its endpoints
+    struct endpoint_status {
+        std::string name;
+        bool primary;
+        /// False once a connection to the endpoint has failed, until a
+        /// health check succeeds
+        bool healthy;
+        /// True if the server reported that it is a standby
+        bool in_recovery;
+        /// The moving average of the time taken by the work sent to the
+        /// endpoint and its health checks
+        std::chrono::microseconds latency;
+        /// The number of `read` or `write` calls using the endpoint now
+        std::size_t in_flight;
+        /// How far behind the primary a replica was at its last health check
+        std::chrono::milliseconds lag;
+        /// The number of connections waiting to be re-used
+        std::size_t idle;
+    };
+
+
+    /// Routes work across a primary server and any number of read replicas.
+    /// Each endpoint is given as a function that opens a new connection to
+    /// it, e.g. using `unix_domain_socket` or `tcp_socket` and `handshake`.
+    /// Connections are kept and re-used once the work using them is done,
+    /// unless the work left them inside a transaction block.
+    ///
+    /// `write` always uses the primary. `read` uses the healthy replica with
+    /// the lowest moving average latency, weighted by the number of reads
+    /// already running on it, so slow or busy replicas get less of the load.
+    /// Replicas that are lagging more than `max_lag` behind the primary are
+    /// skipped, and if there is no replica that can be used the primary is
+    /// used instead.
+    ///
+    /// An endpoint is taken out of use when connecting to it, or using a
+    /// connection to it, fails with anything other than a `postgres_error`.
+    /// The health checks, run by `check` or periodically by `monitor`,
+    /// bring it back and also measure how far each replica is lagging.
+    ///
+    /// The endpoints must all be added before the router is used, after
+    /// which it can be used from coroutines on any thread. All of the
+    /// endpoints share the socket type `S`.
+    template<typename S>
+    class router {
+    public:
+        /// Opens a new connection to an endpoint
+        using connector = std::function<connection<S>(boost::asio::yield_context)>;
+
+    private:
+        struct endpoint {
+            std::string name;
+            connector connect;
+            bool primary;
+            bool healthy = true, in_recovery = false;
+            /// Microseconds. Empty until the first measurement
+            std::optional<double> latency;
+            std::size_t in_flight{};
+            std::chrono::milliseconds lag{};
+            std::vector<connection<S>> idle;
+
+            endpoint(std::string n, connector c, bool p)
+            : name(std::move(n)), connect(std::move(c)), primary{p} {
+            }
+
+            void measured(std::chrono::steady_clock::duration taken) {
+                const double us = std::chrono::duration<double, std::micro>(taken).count();
+                /// An exponentially weighted moving average
+                latency = latency ? *latency * 0.8 + us * 0.2 : us;
+            }
+        };
+
+        class lease;
+        struct state : public std::enable_shared_from_this<state> {
+            /// An executor strand, so that the monitor's `yield` converts
+            /// to the `yield_context` the connector takes
+            boost::asio::strand<boost::asio::io_service::executor_type> strand;
+            boost::asio::steady_timer timer;
+            const std::chrono::steady_clock::duration max_lag;
+            std::mutex mutex;
+            std::vector<std::unique_ptr<endpoint>> endpoints;
+            bool closed = false;
+
+            state(boost::asio::io_service &ios, std::chrono::steady_clock::duration l)
+            : strand{boost::asio::make_strand(ios)}, timer{ios}, max_lag{l} {
+            }
+
+            /// Pick the endpoint to use, skipping the ones already tried.
+            /// Called with the lock held
+            endpoint *choose(bool read, const std::vector<endpoint *> &tried) {
+                endpoint *best = nullptr;
+                double best_score{};
+                if ( read ) {
+                    for ( auto &ep : endpoints ) {
+                        if ( ep->primary || not ep->healthy || ep->lag > max_lag ) continue;
+                        if ( std::find(tried.begin(), tried.end(), ep.get()) != tried.end() ) continue;
+                        /// Endpoints that haven't been measured yet score
+                        /// zero so that they get tried
+                        const double score = ep->latency.value_or(0) * (1 + ep->in_flight);
+                        if ( not best || score < best_score ||
+                                (score == best_score && ep->in_flight < best->in_flight) )
+                        {
+                            best = ep.get();
+                            best_score = score;
+                        }
+                    }
+                }
+                if ( not best ) {
+                    auto primary = endpoints.front().get();
+                    if ( std::find(tried.begin(), tried.end(), primary) == tried.end() ) {
+                        best = primary;
+                    }
+                }
+                if ( best ) ++best->in_flight;
+                return best;
+            }
+
+            void release(
+                endpoint &ep, std::optional<connection<S>> cnx, bool usable,
+                std::optional<std::chrono::steady_clock::duration> taken
+            ) {
+                std::unique_lock<std::mutex> lock{mutex};
+                --ep.in_flight;
+                if ( taken ) ep.measured(*taken);
+                /// A connection left inside a transaction block, failed or
+                /// not, would carry that state into the next piece of work,
+                /// so it is closed rather than re-used
+                if ( cnx && usable && not closed && cnx->transaction_status == 'I' ) {
+                    ep.idle.push_back(std::move(*cnx));
+                } else if ( not usable ) {
+                    ep.healthy = false;
+                    /// Connections opened at the same time as the one that
+                    /// failed are likely to be broken as well
+                    ep.idle.clear();
+                }
+            }
+
+            /// Run the health checks
+            template<typename Y>
+            void check(Y yield) {
+                std::vector<endpoint *> checking;
+                {
+                    std::unique_lock<std::mutex> lock{mutex};
+                    for ( auto &ep : endpoints ) checking.push_back(ep.get());
+                }
+                for ( auto ep : checking ) {
+                    bool in_recovery{};
+                    std::chrono::milliseconds lag{};
+                    bool reached = false;
+                    {
+                        std::unique_ptr<lease> held;
+                        std::unique_lock<std::mutex> lock{mutex};
+                        ++ep->in_flight;
+                        if ( ep->idle.size() ) {
+                            held = std::make_unique<lease>(
+                                this->shared_from_this(), *ep, std::move(ep->idle.back()));
+                            ep->idle.pop_back();
+                        }
+                        lock.unlock();
+                        if ( not held ) {
+                            try {
+                                held = std::make_unique<lease>(
+                                    this->shared_from_this(), *ep, ep->connect(yield));
+                            } catch ( std::exception & ) {
+                                /// Includes Postgres refusing the connection,
+                                /// e.g. because it is still starting up
+                            }
+                            if ( not held ) {
+                                release(*ep, std::nullopt, false, std::nullopt);
+                                continue;
+                            }
+                        }
+                        try {
+                            /// When a replica has replayed everything it has
+                            /// received it isn't lagging, however old the last
+                            /// transaction is
+                            auto results = query(*held->cnx,
+                                "SELECT pg_is_in_recovery(), CASE "
+                                    "WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+                                    "ELSE EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) "
+                                    "END", yield);
+                            while ( auto rs = results.recordset(yield) ) {
+                                while ( auto block = rs.next_block(yield) ) {
+                                    const auto fields = block.fields();
+                                    if ( fields.size() < 2 ) continue;
+                                    in_recovery = fields[0].size() && fields[0][0] == 't';
+                                    if ( fields[1].data() ) {
+                                        const std::string seconds(fields[1].begin(), fields[1].end());
+                                        lag = std::chrono::milliseconds(
+                                            int64_t(std::stod(seconds) * 1000));
+                                    }
+                                }
+                            }
+                            held->done();
+                            reached = true;
+                        } catch ( postgres_error & ) {
+                            /// The server is there, but e.g. too old to
+                            /// report its replication status
+                            held->keep();
+                            reached = true;
+                        } catch ( std::exception & ) {
+                            /// The lease marks the endpoint as unhealthy
+                        }
+                    }
+                    std::unique_lock<std::mutex> lock{mutex};
+                    if ( reached ) {
+                        ep->healthy = true;
+                        ep->in_recovery = in_recovery;
+                        ep->lag = lag;
+                    }
+                }
+            }
+        };
+
+        /// A connection that is returned to its endpoint when it's done with
+        class lease {
+            std::shared_ptr<state> router;
+            const std::chrono::steady_clock::time_point started;
+            bool usable = false;
+            std::optional<std::chrono::steady_clock::duration> taken;
+
+        public:
+            endpoint &ep;
+            std::optional<connection<S>> cnx;
+
+            lease(std::shared_ptr<state> r, endpoint &e, connection<S> c)
+            : router{std::move(r)}, started{std::chrono::steady_clock::now()},
+                ep{e}, cnx{std::move(c)}
+            {
+            }
+            ~lease() {
+                router->release(ep, std::move(cnx), usable, taken);
+            }
+
+            /// The work succeeded
+            void done() {
+                usable = true;
+                taken = std::chrono::steady_clock::now() - started;
+            }
+            /// Postgres reported an error, but the connection is still fine
+            void keep() {
+                usable = true;
+            }
+        };
+
+        std::shared_ptr<state> work;
+
+        template<typename Y>
+        std::unique_ptr<lease> acquire(bool read, Y yield) {
+            std::vector<endpoint *> tried;
+            std::exception_ptr error;
+            while ( true ) {
+                std::unique_lock<std::mutex> lock{work->mutex};
+                auto ep = work->choose(read, tried);
+                if ( not ep ) std::rethrow_exception(error);
+                tried.push_back(ep);
+                if ( ep->idle.size() ) {
+                    auto cnx = std::move(ep->idle.back());
+                    ep->idle.pop_back();
+                    return std::make_unique<lease>(work, *ep, std::move(cnx));
+                }
+                lock.unlock();
+                try {
+                    return std::make_unique<lease>(work, *ep, ep->connect(yield));
+                } catch ( ... ) {
+                    error = std::current_exception();
+                }
+                /// Take the endpoint out of use and try the next best one
+                work->release(*ep, std::nullopt, false, std::nullopt);
+            }
+        }
+
+        template<typename F, typename Y>
+        auto run(bool read, F f, Y yield) {
+            auto held = acquire(read, yield);
+            try {
+                if constexpr ( std::is_void<decltype(f(*held->cnx, yield))>::value ) {
+                    f(*held->cnx, yield);
+                    held->done();
+                } else {
+                    auto result = f(*held->cnx, yield);
+                    held->done();
+                    return result;
+                }
+            } catch ( postgres_error & ) {
+                held->keep();
+                throw;
+            }
+        }
+
+    public:
+        /// Create a router for the primary. Replicas more than `max_lag`
+        /// behind the primary aren't used for reads.
+        router(
+            boost::asio::io_service &ios, std::string name, connector primary,
+            std::chrono::steady_clock::duration max_lag = std::chrono::seconds{10}
+        ) : work{std::make_shared<state>(ios, max_lag)} {
+            work->endpoints.push_back(
+                std::make_unique<endpoint>(std::move(name), std::move(primary), true));
+        }
+
+        /// Not copyable
+        router(const router &) = delete;
+        router &operator = (const router &) = delete;
+
+        /// Stops the health checks and closes the idle connections
+        ~router() {
+            close();
+        }
+
+        /// Add a read replica
+        void replica(std::string name, connector connect) {
+            std::unique_lock<std::mutex> lock{work->mutex};
+            work->endpoints.push_back(
+                std::make_unique<endpoint>(std::move(name), std::move(connect), false));
+        }
+
+        /// Run `f(cnx, yield)` using a connection to the best replica and
+        /// return its result. The work must only read from the database.
+        template<typename F, typename Y>
+        auto read(F f, Y yield) {
+            return run(true, std::move(f), yield);
+        }
+        /// Run `f(cnx, yield)` using a connection to the primary and return
+        /// its result
+        template<typename F, typename Y>
+        auto write(F f, Y yield) {
+            return run(false, std::move(f), yield);
+        }
+
+        /// Check every endpoint, measuring its latency and, for replicas,
+        /// how far it is lagging behind the primary. Endpoints that can be
+        /// reached are put back into use.
+        template<typename Y>
+        void check(Y yield) {
+            work->check(yield);
+        }
+
+        /// Run the health checks every `interval`, until the router is
+        /// closed. The checks run in a coroutine on the `io_service` that
+        /// the router was created with.
+        void monitor(std::chrono::steady_clock::duration interval) {
+            boost::asio::spawn(work->strand, [work = work, interval](auto yield) {
+                while ( true ) {
+                    {
+                        std::unique_lock<std::mutex> lock{work->mutex};
+                        if ( work->closed ) return;
+                    }
+                    work->check(yield);
+                    work->timer.expires_after(interval);
+                    boost::system::error_code ignored;
+                    work->timer.async_wait(yield[ignored]);
+                }
+            });
+        }
+
+        /// The state of each endpoint, starting with the primary
+        std::vector<endpoint_status> status() const {
+            std::unique_lock<std::mutex> lock{work->mutex};
+            std::vector<endpoint_status> endpoints;
+            for ( const auto &ep : work->endpoints ) {
+                endpoints.push_back(endpoint_status{ep->name, ep->primary, ep->healthy,
+                    ep->in_recovery, std::chrono::microseconds(int64_t(ep->latency.value_or(0))),
+                    ep->in_flight, ep->lag, ep->idle.size()});
+            }
+            return endpoints;
+        }
+
+        /// Stop the health checks and close the idle connections. Work that
+        /// is still running is allowed to finish.
+        void close() {
+            std::unique_lock<std::mutex> lock{work->mutex};
+            work->closed = true;
+            for ( auto &ep : work->endpoints ) ep->idle.clear();
+            boost::asio::post(work->strand, [work = work]() { work->timer.cancel(); });
+        }
+    };
+
+
+}
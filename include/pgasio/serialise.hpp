@@ -0,0 +1,392 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/channel.hpp>
+#include <pgasio/query.hpp>
+#include <pgasio/types.hpp>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/write.hpp>
+
+#include <cctype>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+namespace pgasio {
+
+
+    /// Return the position of the first byte in the text that is either `a`,
+    /// `b` or an ASCII control character. If there are none then the size
+    /// of the text is returned. The text is scanned 32 or 16 bytes at a time
+    /// where the processor supports it.
+    inline std::size_t find_special(byte_view text, unsigned char a, unsigned char b) {
+        const auto data = text.data();
+        const auto size = text.size();
+        std::size_t pos{};
+#if defined(__AVX2__)
+        {
+            const auto va = _mm256_set1_epi8(a), vb = _mm256_set1_epi8(b),
+                control = _mm256_set1_epi8(0x1f);
+            for ( ; pos + 32 <= size; pos += 32 ) {
+                const auto chunk = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + pos));
+                const auto special = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)),
+                    _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+                if ( const unsigned mask = _mm256_movemask_epi8(special) ) {
+                    return pos + __builtin_ctz(mask);
+                }
+            }
+        }
+#endif
+#if defined(__SSE2__)
+        {
+            const auto va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b),
+                control = _mm_set1_epi8(0x1f);
+            for ( ; pos + 16 <= size; pos += 16 ) {
+                const auto chunk = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + pos));
+                const auto special = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)),
+                    _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+                if ( const unsigned mask = _mm_movemask_epi8(special) ) {
+                    return pos + __builtin_ctz(mask);
+                }
+            }
+        }
+#endif
+        for ( ; pos < size; ++pos ) {
+            const auto c = data[pos];
+            if ( c == a || c == b || c < 0x20 ) return pos;
+        }
+        return size;
+    }
+
+
+    /// Append the bytes to the string
+    inline std::string &append_bytes(std::string &out, byte_view text) {
+        return out.append(reinterpret_cast<const char *>(text.data()), text.size());
+    }
+
+
+    /// Append text as a JSON string, with quotes and any escaping needed
+    inline std::string &json_string(std::string &out, byte_view text) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        while ( true ) {
+            const auto pos = find_special(text, '"', '\\');
+            append_bytes(out, text.slice(0, pos));
+            if ( pos == text.size() ) break;
+            const auto c = text[pos];
+            switch ( c ) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                (out += "\\u00") += hex[c >> 4];
+                out += hex[c & 0xf];
+            }
+            text = text.slice(pos + 1);
+        }
+        return out += '"';
+    }
+
+
+    /// Append text as a CSV field. The field is only quoted if it needs to be
+    inline std::string &csv_field(std::string &out, byte_view text) {
+        auto pos = find_special(text, '"', ',');
+        if ( pos == text.size() ) return append_bytes(out, text);
+        out += '"';
+        while ( true ) {
+            append_bytes(out, text.slice(0, pos));
+            if ( pos == text.size() ) break;
+            if ( text[pos] == '"' ) out += '"';
+            out += text[pos];
+            text = text.slice(pos + 1);
+            pos = find_special(text, '"', '"');
+        }
+        return out += '"';
+    }
+
+
+    /// The text formats that data can be converted to
+    enum class text_format {
+        /// [Comma Separated JSON](http://www.kirit.com/Comma%20Separated%20JSON)
+        csj,
+        /// RFC 4180 comma separated values with a header line
+        csv,
+        /// One JSON object per line
+        ndjson
+    };
+
+
+    /// Converts `record_block`s into text. The conversion doesn't change
+    /// the serialiser, so a single instance can be used from many threads
+    /// at once.
+    class serialiser {
+        /// How a column's values are written as JSON
+        enum class kind {
+            /// Numbers that can be written directly
+            integer,
+            /// Floating point values might be `NaN` or `Infinity`, which
+            /// have to be strings in JSON
+            floating,
+            boolean,
+            /// Already JSON text
+            json,
+            /// Strings that never need escaping
+            safe_string,
+            /// Any other text
+            string
+        };
+        /// Built from the column types. With a type registry domains get
+        /// the same treatment as the type they're based on
+        static type_dispatch<kind> kinds_for(std::shared_ptr<const type_registry> types) {
+            type_dispatch<kind> kinds{kind::string, std::move(types)};
+            kinds.add(16, kind::boolean) // bool
+                .add(20, kind::integer) // int8
+                .add(21, kind::integer) // int2
+                .add(23, kind::integer) // int4
+                .add(26, kind::integer) // oid
+                .add(700, kind::floating) // float4
+                .add(701, kind::floating) // float8
+                .add(114, kind::json) // json
+                .add(3802, kind::json) // jsonb
+                .add(1082, kind::safe_string) // date
+                .add(1083, kind::safe_string) // time
+                .add(1114, kind::safe_string) // timestamp without time zone
+                .add(1184, kind::safe_string) // timestamp with time zone
+                .add(1700, kind::safe_string) // numeric
+                .add(2950, kind::safe_string); // uuid
+            return kinds;
+        }
+
+        text_format format;
+        std::vector<kind> kinds;
+        std::string head;
+        /// The JSON object keys for `ndjson`, complete with the separators
+        std::vector<std::string> keys;
+
+        void json_value(std::string &out, kind k, byte_view field) const {
+            if ( field.data() == nullptr ) {
+                out += "null";
+                return;
+            }
+            switch ( k ) {
+            case kind::boolean:
+                out += field.size() && field[0] == 't' ? "true" : "false";
+                break;
+            case kind::floating:
+                if ( field.size() && std::isalpha(field[field.size() - 1]) ) {
+                    (append_bytes(out += '"', field)) += '"';
+                    break;
+                }
+                [[fallthrough]];
+            case kind::integer:
+            case kind::json:
+                append_bytes(out, field);
+                break;
+            case kind::safe_string:
+                (append_bytes(out += '"', field)) += '"';
+                break;
+            case kind::string:
+                json_string(out, field);
+            }
+        }
+
+    public:
+        /// The `types`, if given, are used to work out how to write columns
+        /// whose types aren't built in
+        serialiser(
+            text_format f, array_view<const column_meta> columns,
+            std::shared_ptr<const type_registry> types = {}
+        ) : format{f} {
+            const auto dispatch = kinds_for(std::move(types));
+            kinds.reserve(columns.size());
+            for ( const auto &col : columns ) {
+                if ( col.format_code != 0 ) {
+                    throw std::invalid_argument(
+                        "Only text format columns can be serialised. Column: " + col.name);
+                }
+                kinds.push_back(dispatch(col.field_type_oid));
+                const byte_view name{
+                    reinterpret_cast<const unsigned char *>(col.name.data()), col.name.size()};
+                switch ( format ) {
+                case text_format::csj:
+                    if ( head.size() ) head += ',';
+                    json_string(head, name);
+                    break;
+                case text_format::csv:
+                    if ( head.size() ) head += ',';
+                    csv_field(head, name);
+                    break;
+                case text_format::ndjson:
+                    keys.emplace_back(keys.empty() ? "{" : ",");
+                    json_string(keys.back(), name) += ':';
+                    break;
+                }
+            }
+            if ( head.size() ) head += '\n';
+        }
+
+        /// The header line (if any) that needs to be output before the data
+        const std::string &header() const {
+            return head;
+        }
+
+        /// Append the text for all of the rows in the block
+        void append(std::string &out, const record_block &block) const {
+            const auto columns = kinds.size();
+            if ( not columns ) return;
+            for ( auto fields = block.fields(); fields.size(); fields = fields.slice(columns) ) {
+                for ( std::size_t index{}; index < columns; ++index ) {
+                    const auto field = fields[index];
+                    switch ( format ) {
+                    case text_format::csj:
+                        if ( index ) out += ',';
+                        json_value(out, kinds[index], field);
+                        break;
+                    case text_format::csv:
+                        if ( index ) out += ',';
+                        if ( field.data() ) csv_field(out, field);
+                        break;
+                    case text_format::ndjson:
+                        out += keys[index];
+                        json_value(out, kinds[index], field);
+                        break;
+                    }
+                }
+                if ( format == text_format::ndjson ) out += '}';
+                out += '\n';
+            }
+        }
+        /// Return the text for the block
+        std::string operator () (const record_block &block) const {
+            std::string out;
+            out.reserve(block.used_bytes() + block.fields().size() * 4);
+            append(out, block);
+            return out;
+        }
+    };
+
+
+    /// Convert the rest of the recordset into text and write it to the
+    /// output stream (e.g. a `boost::asio::posix::stream_descriptor`). The
+    /// conversion of blocks is spread across `workers` coroutines on the
+    /// `io_service`, so it should be run by as many threads as there are
+    /// cores. The text is put back into order and written using gathered
+    /// writes of up to `gather` blocks at a time. If `load_types` has been
+    /// called for the connection then its types are used for the columns.
+    ///
+    /// This returns once all of the text has been written. Once anything
+    /// fails no more text is written. An exception from the conversion or
+    /// writing of the text is re-thrown here after the remaining data has
+    /// been read from the recordset. An exception from reading the
+    /// recordset itself stops the reading, and is re-thrown once the
+    /// workers have finished, so the connection is left in the same state
+    /// as if `next_block` had thrown.
+    template<typename S, typename W, typename Y> inline
+    void write_recordset(
+        boost::asio::io_service &ios, recordset<S> &rs,
+        text_format format, W &output, std::size_t workers, Y yield,
+        std::size_t gather = 64, std::size_t budget = 64u << 20
+    ) {
+        assert(workers > 0);
+        struct pipeline {
+            const serialiser convert;
+            channel<std::pair<std::size_t, record_block>> blocks;
+            reorder<std::string> text;
+            std::mutex mutex;
+            waiting writer;
+            bool written = false;
+            std::exception_ptr error;
+
+            pipeline(text_format f, recordset<S> &rs, std::size_t w, std::size_t b)
+            : convert{f, rs.columns(), rs.types()}, blocks{b}, text{2 * w + 2} {
+            }
+            void failed() {
+                std::unique_lock<std::mutex> lock{mutex};
+                if ( not error ) error = std::current_exception();
+            }
+            bool ok() {
+                std::unique_lock<std::mutex> lock{mutex};
+                return not error;
+            }
+        };
+        auto work = std::make_shared<pipeline>(format, rs, workers, budget);
+
+        for ( std::size_t w{}; w < workers; ++w ) {
+            boost::asio::spawn(ios, [work](auto yield) {
+                while ( auto item = work->blocks.consume(yield) ) {
+                    std::string out;
+                    try {
+                        out = work->convert(item->second);
+                    } catch ( ... ) {
+                        work->failed();
+                    }
+                    work->text.push(item->first, std::move(out), yield);
+                }
+            });
+        }
+        boost::asio::spawn(ios, [work, &output, gather](auto yield) {
+            std::vector<std::string> chunks;
+            std::vector<boost::asio::const_buffer> buffers;
+            while ( auto chunk = work->text.pop(yield) ) {
+                chunks.push_back(std::move(*chunk));
+                while ( chunks.size() < gather ) {
+                    auto more = work->text.try_pop();
+                    if ( not more ) break;
+                    chunks.push_back(std::move(*more));
+                }
+                for ( const auto &c : chunks ) {
+                    if ( c.size() ) buffers.push_back(boost::asio::buffer(c));
+                }
+                if ( buffers.size() && work->ok() ) {
+                    try {
+                        boost::asio::async_write(output, buffers, yield);
+                    } catch ( ... ) {
+                        work->failed();
+                    }
+                }
+                buffers.clear();
+                chunks.clear();
+            }
+            std::unique_lock<std::mutex> lock{work->mutex};
+            work->written = true;
+            work->writer.notify_all();
+        });
+
+        work->text.push(0, work->convert.header(), yield);
+        std::size_t sequence{1};
+        try {
+            while ( auto block = rs.next_block(yield) ) {
+                const auto bytes = block.memory_size();
+                work->blocks.produce({sequence++, std::move(block)}, bytes, yield);
+            }
+        } catch ( ... ) {
+            work->failed();
+        }
+        work->blocks.close();
+        work->text.close(sequence);
+
+        std::unique_lock<std::mutex> lock{work->mutex};
+        while ( not work->written ) work->writer.wait(lock, yield);
+        if ( work->error ) std::rethrow_exception(work->error);
+    }
+
+
+}
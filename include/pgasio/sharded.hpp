@@ -0,0 +1,224 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/slab_pool.hpp>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/spawn.hpp>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+
+namespace pgasio {
+
+
+    /// A thread per core runtime. Each shard has its own `io_service`, run
+    /// by a single thread that is pinned to one core, and its own
+    /// `slab_pool` for record blocks. Connections opened by a coroutine on a
+    /// shard stay on that shard, so their state and their blocks stay in
+    /// that core's caches and no locks are needed to use them.
+    ///
+    /// Work is moved between shards only by asking for it, using `spawn`,
+    /// `post` or `call` with the target shard number.
+    class sharded {
+        struct shard {
+            /// Each `io_service` is only ever run by one thread
+            boost::asio::io_service ios{1};
+            std::shared_ptr<slab_pool> slabs;
+            std::optional<boost::asio::io_service::work> running;
+
+            shard(std::size_t slab_bytes)
+            : slabs{std::make_shared<slab_pool>(slab_bytes)} {
+            }
+        };
+        std::vector<std::unique_ptr<shard>> shards;
+        std::mutex mutex;
+        std::exception_ptr error;
+
+        static std::optional<std::size_t> &this_shard() {
+            static thread_local std::optional<std::size_t> index;
+            return index;
+        }
+
+        /// Pin the calling thread to the n'th core that the process is
+        /// allowed to use
+        static void pin(std::size_t n) {
+#ifdef __linux__
+            cpu_set_t allowed;
+            if ( ::sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ) return;
+            const auto cores = std::size_t(CPU_COUNT(&allowed));
+            if ( not cores ) return;
+            for ( std::size_t cpu{}, seen{}; cpu < CPU_SETSIZE; ++cpu ) {
+                if ( CPU_ISSET(cpu, &allowed) && seen++ == n % cores ) {
+                    cpu_set_t one;
+                    CPU_ZERO(&one);
+                    CPU_SET(cpu, &one);
+                    ::pthread_setaffinity_np(::pthread_self(), sizeof(one), &one);
+                    return;
+                }
+            }
+#endif
+        }
+
+    public:
+        /// Create the shards. The default is one for each core. The
+        /// `slab_bytes` are used for each shard's `slab_pool`.
+        explicit sharded(
+            std::size_t count = std::max(std::thread::hardware_concurrency(), 1u),
+            std::size_t slab_bytes = 4u << 20
+        ) {
+            for ( std::size_t s{}; s < std::max(count, std::size_t{1}); ++s ) {
+                shards.push_back(std::make_unique<shard>(slab_bytes));
+            }
+        }
+
+        /// Not copyable or movable
+        sharded(const sharded &) = delete;
+        sharded &operator = (const sharded &) = delete;
+
+        /// The number of shards
+        std::size_t size() const {
+            return shards.size();
+        }
+        /// The shard whose thread is calling, or an empty value if it isn't
+        /// one of the shard threads
+        static std::optional<std::size_t> current() {
+            return this_shard();
+        }
+        /// The shard that owns work with this key, e.g. a hash of a tenant
+        /// or a connection string
+        std::size_t shard_for(std::size_t key) const {
+            return key % shards.size();
+        }
+
+        /// The `io_service` for the shard. Connections for the shard must be
+        /// opened on this
+        boost::asio::io_service &io_service(std::size_t s) {
+            return shards.at(s)->ios;
+        }
+        /// The slab pool for the shard. Use it for the blocks read on the
+        /// shard, e.g. `rs.next_block(runtime.slabs(s)->slab(), yield)`
+        const std::shared_ptr<slab_pool> &slabs(std::size_t s) {
+            return shards.at(s)->slabs;
+        }
+
+        /// Start a coroutine on the shard. This can be called from any thread
+        template<typename F>
+        void spawn(std::size_t s, F f) {
+            boost::asio::spawn(io_service(s), std::move(f));
+        }
+        /// Run the function on the shard. This can be called from any thread
+        template<typename F>
+        void post(std::size_t s, F f) {
+            boost::asio::post(io_service(s), std::move(f));
+        }
+
+        /// Run `f(yield)` in a coroutine on the shard and suspend the calling
+        /// coroutine until it's done, returning its result or throwing its
+        /// exception. The calling coroutine is resumed on its own shard.
+        template<typename F, typename Y>
+        auto call(std::size_t s, F f, Y yield) {
+            using result_type = decltype(f(std::declval<boost::asio::yield_context>()));
+            struct outcome {
+                std::conditional_t<std::is_void<result_type>::value,
+                    bool, std::optional<result_type>> value;
+                std::exception_ptr error;
+            };
+            auto done = std::make_shared<outcome>();
+            boost::asio::async_completion<Y, void(boost::system::error_code)>
+                completion{yield};
+            auto executor = boost::asio::get_associated_executor(
+                completion.completion_handler);
+            /// The calling coroutine's shard mustn't run out of work whilst
+            /// it's suspended
+            spawn(s, [f = std::move(f), done, executor,
+                    work = boost::asio::make_work_guard(executor),
+                    handler = std::move(completion.completion_handler)](auto yield) mutable {
+                try {
+                    if constexpr ( std::is_void<result_type>::value ) {
+                        f(yield);
+                    } else {
+                        done->value.emplace(f(yield));
+                    }
+                } catch ( ... ) {
+                    done->error = std::current_exception();
+                }
+                boost::asio::post(executor, [handler = std::move(handler)]() mutable {
+                    handler(boost::system::error_code{});
+                });
+                work.reset();
+            });
+            completion.result.get();
+            if ( done->error ) std::rethrow_exception(done->error);
+            if constexpr ( not std::is_void<result_type>::value ) {
+                return std::move(*done->value);
+            }
+        }
+
+        /// Run every shard on its own pinned thread, blocking until they
+        /// have all stopped. The shards keep running until `finish` or
+        /// `stop` is called, so work can always be sent between them. If a
+        /// shard exits with an exception then all of the shards are stopped
+        /// and the exception is re-thrown here.
+        void run(bool pin_threads = true) {
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                for ( auto &s : shards ) s->running.emplace(s->ios);
+            }
+            std::vector<std::thread> threads;
+            for ( std::size_t s{}; s < shards.size(); ++s ) {
+                threads.emplace_back([this, s, pin_threads]() {
+                    if ( pin_threads ) pin(s);
+                    this_shard() = s;
+                    try {
+                        shards[s]->ios.run();
+                    } catch ( ... ) {
+                        {
+                            std::unique_lock<std::mutex> lock{mutex};
+                            if ( not error ) error = std::current_exception();
+                        }
+                        stop();
+                    }
+                    this_shard().reset();
+                });
+            }
+            for ( auto &t : threads ) t.join();
+            for ( auto &s : shards ) s->ios.restart();
+            std::unique_lock<std::mutex> lock{mutex};
+            if ( error ) {
+                auto e = error;
+                error = nullptr;
+                std::rethrow_exception(e);
+            }
+        }
+
+        /// Let each shard stop once it has run out of work. No more work
+        /// should be sent to other shards after this.
+        void finish() {
+            std::unique_lock<std::mutex> lock{mutex};
+            for ( auto &s : shards ) s->running.reset();
+        }
+        /// Stop all of the shards straight away
+        void stop() {
+            finish();
+            for ( auto &s : shards ) s->ios.stop();
+        }
+    };
+
+
+}
@@ -0,0 +1,172 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/memory.hpp>
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+
+
+namespace pgasio {
+
+
+    /// A pool of `unaligned_slab`s backed by anonymous memory mappings. The
+    /// mappings use huge pages where the system has them, which cuts the
+    /// number of page faults and TLB entries needed for large slabs, and the
+    /// memory is never zeroed by the process. Slabs are given back to the
+    /// pool when they're destroyed, so the mappings are re-used by later
+    /// slabs rather than being faulted in again.
+    ///
+    /// Slabs can be destroyed on any thread. The pool must be managed by a
+    /// `std::shared_ptr` because the slabs keep it alive.
+    class slab_pool : public std::enable_shared_from_this<slab_pool> {
+    public:
+        /// What happens to the memory of a slab that is returned to the pool
+        enum class reclaim {
+            /// The pages are kept as they are
+            keep,
+            /// The kernel may take the pages back if it is short of memory
+            /// (`MADV_FREE`). If it doesn't then re-using them costs nothing
+            lazy,
+            /// The pages are given back straight away (`MADV_DONTNEED`) and
+            /// will be faulted in again when the slab is re-used
+            eager
+        };
+
+    private:
+        std::mutex mutex;
+        std::vector<raw_memory> idle;
+        std::size_t m_mapped;
+
+        static constexpr std::size_t huge_page = 2u << 20;
+
+        raw_memory map() {
+#ifdef MAP_HUGETLB
+            if ( use_hugetlb ) {
+                void *memory = ::mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if ( memory != MAP_FAILED ) {
+                    return raw_memory{reinterpret_cast<unsigned char *>(memory), slab_size};
+                }
+                /// There are no huge pages reserved, so use transparent
+                /// huge pages from now on
+                use_hugetlb = false;
+            }
+#endif
+            void *memory = ::mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if ( memory == MAP_FAILED ) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+            ::madvise(memory, slab_size, MADV_HUGEPAGE);
+#endif
+            return raw_memory{reinterpret_cast<unsigned char *>(memory), slab_size};
+        }
+
+        void give_back(raw_memory memory) {
+            /// The advice must be given before the mapping goes back into
+            /// the idle list, as it may be re-used straight away
+            if ( retain ) advise(memory);
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                if ( idle.size() < retain ) {
+                    idle.push_back(memory);
+                    return;
+                }
+                --m_mapped;
+            }
+            ::munmap(memory.data(), memory.size());
+        }
+
+        void advise(raw_memory memory) {
+            switch ( reclaim_pages ) {
+            case reclaim::keep:
+                break;
+            case reclaim::lazy:
+#ifdef MADV_FREE
+                /// Huge TLB mappings and older kernels don't support
+                /// `MADV_FREE`
+                if ( ::madvise(memory.data(), memory.size(), MADV_FREE) == 0 ) break;
+#endif
+                [[fallthrough]];
+            case reclaim::eager:
+                ::madvise(memory.data(), memory.size(), MADV_DONTNEED);
+                break;
+            }
+        }
+
+        std::atomic<bool> use_hugetlb;
+
+    public:
+        /// The size of each slab. This is rounded up to a whole number of
+        /// huge pages
+        const std::size_t slab_size;
+        /// The number of idle mappings the pool keeps for re-use
+        const std::size_t retain;
+        /// What is done with the pages of idle mappings
+        const reclaim reclaim_pages;
+
+        /// The default slab size matches the default `record_block` size.
+        /// Setting `hugetlb` asks for pages from the huge page pool the
+        /// system administrator has reserved; if there aren't any then
+        /// transparent huge pages are asked for instead.
+        explicit slab_pool(
+            std::size_t bytes = 4u << 20, std::size_t r = 32,
+            reclaim how = reclaim::lazy, bool hugetlb = true
+        ) : m_mapped{}, use_hugetlb{hugetlb},
+            slab_size{(bytes + huge_page - 1) / huge_page * huge_page},
+            retain{r}, reclaim_pages{how}
+        {
+        }
+
+        /// Not copyable or movable
+        slab_pool(const slab_pool &) = delete;
+        slab_pool &operator = (const slab_pool &) = delete;
+
+        ~slab_pool() {
+            for ( auto memory : idle ) ::munmap(memory.data(), memory.size());
+        }
+
+        /// The number of mappings that currently exist, both in use and idle
+        std::size_t mapped() {
+            std::unique_lock<std::mutex> lock{mutex};
+            return m_mapped;
+        }
+
+        /// Return a slab, re-using an idle mapping if there is one
+        unaligned_slab slab() {
+            /// Anything that can throw is done before the memory is taken,
+            /// so a pool that isn't managed by a `std::shared_ptr` doesn't
+            /// lose a mapping
+            std::function<void(raw_memory)> release{
+                [pool = shared_from_this()](raw_memory m) {
+                    pool->give_back(m);
+                }};
+            raw_memory memory;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                if ( idle.size() ) {
+                    memory = idle.back();
+                    idle.pop_back();
+                }
+            }
+            if ( not memory.data() ) {
+                memory = map();
+                std::unique_lock<std::mutex> lock{mutex};
+                ++m_mapped;
+            }
+            return unaligned_slab{memory, std::move(release)};
+        }
+    };
+
+
+}
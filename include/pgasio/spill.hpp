@@ -0,0 +1,314 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/query.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <limits>
+#include <system_error>
+
+
+namespace pgasio {
+
+
+    /// The spill file format is a sequence of messages framed in the same
+    /// way as the Postgres protocol, i.e. a type byte followed by a 32 bit
+    /// big endian length that includes itself:
+    ///
+    /// 1. The eight bytes of `spill_magic`.
+    /// 2. A _RowDescription_ (`T`) message describing the columns.
+    /// 3. For each block a `B` message holding the number of fields, an
+    ///     offset and size for each field (an offset of -1 is a `NULL`) and
+    ///     the number of bytes of row data. The row data follows straight
+    ///     after the message, unframed, exactly as it is held in the
+    ///     `record_block`.
+    /// 4. A `C` message with the total number of rows and blocks, showing
+    ///     that the file is complete.
+    constexpr const char spill_magic[] = "PGASIOS1";
+
+
+    /// Writes `record_block`s to a spill file. The index for each block is
+    /// assembled in memory, but the row data is written directly from the
+    /// block using a gathered write.
+    ///
+    /// The writes are blocking system calls, so for very large result sets
+    /// it is best to call `write` from a coroutine on an `io_service` that
+    /// isn't also being used for latency sensitive work.
+    class spill_writer {
+        int fd;
+        command_buffer buffer;
+        std::size_t m_rows, m_blocks, columns;
+
+        void write_all(iovec *parts, int count) {
+            while ( count ) {
+                const auto written = ::writev(fd, parts, count);
+                if ( written < 0 ) {
+                    if ( errno == EINTR ) continue;
+                    throw std::system_error(errno, std::system_category(),
+                        "Writing the spill file");
+                }
+                std::size_t left = written;
+                while ( count && left >= parts->iov_len ) {
+                    left -= parts->iov_len;
+                    ++parts, --count;
+                }
+                if ( count ) {
+                    parts->iov_base = static_cast<char *>(parts->iov_base) + left;
+                    parts->iov_len -= left;
+                }
+            }
+        }
+        void write_buffer() {
+            buffer.finish();
+            const auto data = buffer.data();
+            iovec part{const_cast<unsigned char *>(data.data()), data.size()};
+            write_all(&part, 1);
+            buffer.clear();
+        }
+
+    public:
+        /// Create (or truncate) the file and write the column descriptions
+        spill_writer(const char *path, array_view<const column_meta> cols)
+        : fd{::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)},
+            m_rows{}, m_blocks{}, columns{cols.size()}
+        {
+            if ( fd < 0 ) {
+                throw std::system_error(errno, std::system_category(),
+                    std::string("Opening spill file ") + path);
+            }
+            buffer.bytes(byte_view{
+                reinterpret_cast<const unsigned char *>(spill_magic), sizeof(spill_magic) - 1});
+            buffer.message('T').int16(cols.size());
+            for ( const auto &col : cols ) {
+                buffer.c_str(col.name).int32(col.table_oid).int16(col.table_column)
+                    .int32(col.field_type_oid).int16(col.data_size)
+                    .int32(col.type_modifier).int16(col.format_code);
+            }
+            write_buffer();
+        }
+
+        /// Not copyable
+        spill_writer(const spill_writer &) = delete;
+        spill_writer &operator = (const spill_writer &) = delete;
+
+        /// Closes the file. If `close` hasn't been called then the file
+        /// won't have its trailer and can't be read back.
+        ~spill_writer() {
+            if ( fd >= 0 ) ::close(fd);
+        }
+
+        /// The number of rows and blocks written so far
+        std::size_t rows() const {
+            return m_rows;
+        }
+        std::size_t blocks() const {
+            return m_blocks;
+        }
+
+        /// Append the block to the file
+        void write(const record_block &block) {
+            assert(fd >= 0);
+            if ( block.columns() != columns ) {
+                throw std::invalid_argument("Block has the wrong number of columns for the spill file");
+            }
+            const auto data = block.data();
+            const auto fields = block.fields();
+            if ( data.size() > std::size_t(std::numeric_limits<int32_t>::max()) ||
+                    fields.size() > (std::numeric_limits<int32_t>::max() - 16u) / 8u )
+            {
+                throw std::length_error("Block is too large for the spill file");
+            }
+            buffer.message('B').int32(fields.size());
+            for ( const auto field : fields ) {
+                if ( field.data() ) {
+                    buffer.int32(field.data() - data.data()).int32(field.size());
+                } else {
+                    buffer.int32(-1).int32(0);
+                }
+            }
+            buffer.int32(data.size()).finish();
+            const auto index = buffer.data();
+            iovec parts[2] = {
+                {const_cast<unsigned char *>(index.data()), index.size()},
+                {const_cast<unsigned char *>(data.data()), data.size()}};
+            write_all(parts, data.size() ? 2 : 1);
+            buffer.clear();
+            ++m_blocks;
+            m_rows += columns ? fields.size() / columns : 0u;
+        }
+
+        /// Write the trailer and close the file
+        void close() {
+            if ( fd < 0 ) return;
+            buffer.message('C').int64(m_rows).int64(m_blocks);
+            write_buffer();
+            const auto closed = ::close(fd);
+            fd = -1;
+            if ( closed < 0 ) {
+                throw std::system_error(errno, std::system_category(),
+                    "Closing the spill file");
+            }
+        }
+    };
+
+
+    /// Write the rest of the recordset to a spill file, returning the
+    /// number of rows written
+    template<typename S, typename Y> inline
+    std::size_t spill_recordset(recordset<S> &rs, const char *path, Y yield) {
+        spill_writer out{path, rs.columns()};
+        while ( auto block = rs.next_block(yield) ) out.write(block);
+        out.close();
+        return out.rows();
+    }
+
+
+    /// A spill file mapped into memory. The blocks it returns point directly
+    /// into the mapping and keep it alive, so they can outlive the
+    /// `spill_file` and can be used on any thread.
+    class spill_file {
+        struct mapping {
+            const unsigned char *base = nullptr;
+            std::size_t size{};
+            ~mapping() {
+                if ( base ) ::munmap(const_cast<unsigned char *>(base), size);
+            }
+        };
+        std::shared_ptr<mapping> memory;
+        std::vector<column_meta> m_columns;
+        /// The start of each block's `B` message
+        std::vector<std::size_t> offsets;
+        std::size_t m_rows;
+
+        static header framing(decoder &d) {
+            const char type = d.read_byte();
+            const auto size = d.read_int32();
+            if ( size < 4 || std::size_t(size - 4) > d.remaining() ) {
+                throw std::runtime_error("Spill file is truncated or corrupt");
+            }
+            return header(type, size);
+        }
+
+    public:
+        /// Map the file and check its structure
+        explicit spill_file(const char *path)
+        : memory{std::make_shared<mapping>()}, m_rows{} {
+            const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+            if ( fd < 0 ) {
+                throw std::system_error(errno, std::system_category(),
+                    std::string("Opening spill file ") + path);
+            }
+            struct stat st;
+            if ( ::fstat(fd, &st) < 0 ) {
+                const auto error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::system_category(), "Sizing the spill file");
+            }
+            memory->size = st.st_size;
+            if ( memory->size ) {
+                void *mapped = ::mmap(nullptr, memory->size, PROT_READ, MAP_PRIVATE, fd, 0);
+                const auto error = errno;
+                ::close(fd);
+                if ( mapped == MAP_FAILED ) {
+                    throw std::system_error(error, std::system_category(), "Mapping the spill file");
+                }
+                memory->base = static_cast<const unsigned char *>(mapped);
+            } else {
+                ::close(fd);
+            }
+
+            const std::size_t magic = sizeof(spill_magic) - 1;
+            if ( memory->size < magic ||
+                    std::memcmp(memory->base, spill_magic, magic) != 0 )
+            {
+                throw std::runtime_error(std::string("Not a spill file: ") + path);
+            }
+            decoder file{byte_view{memory->base, memory->size}.slice(magic)};
+            const auto description = framing(file);
+            if ( description.type != 'T' ) {
+                throw std::runtime_error("Spill file doesn't start with a row description");
+            }
+            m_columns = row_description(file.read_bytes(description.body_size));
+            while ( true ) {
+                const std::size_t at = memory->size - file.remaining();
+                const auto next = framing(file);
+                decoder body{file.read_bytes(next.body_size)};
+                if ( next.type == 'B' ) {
+                    const std::size_t fields = body.read_int32();
+                    if ( body.remaining() != fields * 8 + 4 ) {
+                        throw std::runtime_error("Spill file block index is corrupt");
+                    }
+                    body.read_bytes(fields * 8);
+                    file.read_bytes(body.read_int32());
+                    offsets.push_back(at);
+                    if ( m_columns.size() ) m_rows += fields / m_columns.size();
+                } else if ( next.type == 'C' ) {
+                    const std::size_t rows = body.read_int64();
+                    const std::size_t blocks = body.read_int64();
+                    if ( rows != m_rows || blocks != offsets.size() ) {
+                        throw std::runtime_error("Spill file trailer doesn't match its content");
+                    }
+                    break;
+                } else {
+                    throw std::runtime_error(
+                        std::string("Unknown spill file message type: ") + next.type);
+                }
+            }
+#ifdef MADV_WILLNEED
+            ::madvise(const_cast<unsigned char *>(memory->base), memory->size, MADV_WILLNEED);
+#endif
+        }
+
+        /// The columns that were written
+        array_view<const column_meta> columns() const {
+            return m_columns;
+        }
+        /// The number of blocks in the file
+        std::size_t size() const {
+            return offsets.size();
+        }
+        /// The total number of rows in the file
+        std::size_t rows() const {
+            return m_rows;
+        }
+
+        /// Return a block. Only the field index is built, the row data is
+        /// not copied.
+        record_block block(std::size_t index) const {
+            decoder file{byte_view{memory->base, memory->size}.slice(offsets.at(index))};
+            decoder body{file.read_bytes(framing(file).body_size)};
+            std::pmr::vector<byte_view> fields(body.read_int32());
+            const auto entries = body.read_bytes(fields.size() * 8);
+            const auto data = file.read_bytes(body.read_int32());
+            decoder entry{entries};
+            for ( auto &field : fields ) {
+                const auto offset = entry.read_int32();
+                const std::size_t bytes = entry.read_int32();
+                if ( offset >= 0 ) {
+                    if ( offset + bytes > data.size() ) {
+                        throw std::runtime_error("Spill file field is outside of its block");
+                    }
+                    field = byte_view{data.data() + offset, bytes};
+                }
+            }
+            unaligned_slab slab{
+                raw_memory{const_cast<unsigned char *>(data.data()), data.size()},
+                [keep = memory](raw_memory) {}};
+            slab.allocate(data.size());
+            return record_block{m_columns.size(), std::move(slab), std::move(fields)};
+        }
+    };
+
+
+}
@@ -0,0 +1,122 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+
+namespace pgasio {
+
+
+    struct column_meta;
+
+
+    /// A least recently used cache of the server side prepared statements
+    /// for a connection, keyed by their SQL text. The cache is disabled
+    /// until it is given a capacity.
+    class statement_cache {
+    public:
+        /// A statement that has been prepared on the server
+        struct statement {
+            /// The name the statement was prepared with
+            std::string name;
+            /// The columns the statement returns, taken from the server's
+            /// description of the statement when it was prepared
+            std::shared_ptr<const std::vector<column_meta>> columns;
+        };
+
+    private:
+        using entry = std::pair<std::string, statement>;
+        std::list<entry> lru;
+        std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+        std::vector<std::string> closing;
+        std::size_t m_capacity, m_hits, m_misses, m_named;
+
+        void evict() {
+            while ( lru.size() > m_capacity ) {
+                index.erase(lru.back().first);
+                closing.push_back(std::move(lru.back().second.name));
+                lru.pop_back();
+            }
+        }
+
+    public:
+        explicit statement_cache(std::size_t c = 0u)
+        : m_capacity{c}, m_hits{}, m_misses{}, m_named{} {
+        }
+
+        /// The maximum number of statements that are kept prepared
+        std::size_t capacity() const {
+            return m_capacity;
+        }
+        /// Change the capacity. Setting it to zero turns off the cache.
+        /// Statements that no longer fit are closed by the next query.
+        void capacity(std::size_t c) {
+            m_capacity = c;
+            evict();
+        }
+
+        /// The number of statements that are currently prepared
+        std::size_t size() const {
+            return lru.size();
+        }
+        /// The number of times a cached statement has been re-used
+        std::size_t hits() const {
+            return m_hits;
+        }
+        /// The number of times a statement had to be prepared
+        std::size_t misses() const {
+            return m_misses;
+        }
+
+        /// Look up the SQL. If it has already been prepared then it becomes
+        /// the most recently used statement.
+        const statement *find(std::string_view sql) {
+            auto found = index.find(sql);
+            if ( found == index.end() ) {
+                ++m_misses;
+                return nullptr;
+            } else {
+                ++m_hits;
+                lru.splice(lru.begin(), lru, found->second);
+                return &found->second->second;
+            }
+        }
+
+        /// Return a new name for a statement that is about to be prepared
+        std::string next_name() {
+            return "pgasio_" + std::to_string(++m_named);
+        }
+
+        /// Record a statement once the server has prepared and described it.
+        /// Older statements are evicted if the cache is full.
+        void insert(std::string sql, statement s) {
+            if ( index.find(sql) != index.end() ) {
+                closing.push_back(std::move(s.name));
+                return;
+            }
+            lru.emplace_front(std::move(sql), std::move(s));
+            index.emplace(lru.front().first, lru.begin());
+            evict();
+        }
+
+        /// Return the names of evicted statements that still need to be
+        /// closed on the server
+        std::vector<std::string> evicted() {
+            auto names = std::move(closing);
+            closing.clear();
+            return names;
+        }
+    };
+
+
+}
@@ -0,0 +1,281 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/binary.hpp>
+
+#include <boost/system/system_error.hpp>
+
+#include <array>
+#include <optional>
+#include <tuple>
+#include <utility>
+
+
+namespace pgasio {
+
+
+    /// The type of the values held for a column of a `typed_block`. Columns
+    /// that can be `NULL` are given as `std::optional<T>`.
+    template<typename T>
+    struct typed_column {
+        using value_type = T;
+        static constexpr bool nullable = false;
+    };
+    template<typename T>
+    struct typed_column<std::optional<T>> {
+        using value_type = T;
+        static constexpr bool nullable = true;
+    };
+
+
+    /// A block of rows whose column types are known at compile time. Each
+    /// column is held in its own vector of decoded values rather than as
+    /// views into the data row messages. The columns must be fixed width
+    /// types that have a `binary_type` and the query must ask for binary
+    /// results. Use a `typed_recordset` to check the columns and read the
+    /// blocks.
+    template<typename... Ts>
+    class typed_block {
+        static_assert(sizeof...(Ts) > 0, "A typed_block needs at least one column");
+        static_assert((std::is_arithmetic<typename typed_column<Ts>::value_type>::value && ...),
+            "The columns of a typed_block must be fixed width");
+
+        std::size_t m_capacity;
+        std::size_t m_rows;
+        std::tuple<std::pmr::vector<Ts>...> m_columns;
+
+        /// The largest data row message body that can be for these columns
+        static constexpr std::size_t max_row_size =
+            2u + ((4u + sizeof(typename typed_column<Ts>::value_type)) + ...);
+        /// A data row message is read into this before it is decoded
+        std::array<unsigned char, max_row_size> row;
+
+        /// Set when a `NULL` is found in a column that can't hold it. The
+        /// rest of the recordset is then skipped before throwing.
+        static constexpr std::size_t npos = ~std::size_t{};
+        std::size_t null_column = npos;
+
+        template<std::size_t I>
+        void decode_field(const unsigned char *&at, const unsigned char *end) {
+            using column = typed_column<std::tuple_element_t<I, std::tuple<Ts...>>>;
+            if ( end - at < 4 ) throw end_of_message();
+            const int32_t bytes = (at[0] << 24) + (at[1] << 16) + (at[2] << 8) + at[3];
+            at += 4;
+            if ( bytes == -1 ) {
+                if constexpr ( column::nullable ) {
+                    std::get<I>(m_columns).emplace_back();
+                } else if ( null_column == npos ) {
+                    null_column = I;
+                }
+            } else {
+                if ( bytes < 0 || end - at < bytes ) throw end_of_message();
+                std::get<I>(m_columns).push_back(
+                    binary_value<typename column::value_type>(byte_view{at, std::size_t(bytes)}));
+                at += bytes;
+            }
+        }
+        template<std::size_t... I>
+        void decode_row(std::size_t bytes, std::index_sequence<I...>) {
+            const unsigned char *at = row.data();
+            const unsigned char *end = at + bytes;
+            if ( bytes < 2 || ((at[0] << 8) + at[1]) != int(sizeof...(Ts)) ) {
+                throw std::runtime_error("Data row doesn't have the expected number of columns");
+            }
+            at += 2;
+            (decode_field<I>(at, end), ...);
+            if ( null_column == npos ) ++m_rows;
+        }
+
+    public:
+        /// An empty block shows that there are no more to come
+        typed_block()
+        : m_capacity{}, m_rows{} {
+        }
+
+        /// The block holds up to `rows` rows, with the columns using memory
+        /// from the memory resource, which must outlive the block
+        explicit typed_block(std::size_t rows,
+            std::pmr::memory_resource *memory = std::pmr::get_default_resource())
+        : m_capacity(rows), m_rows{},
+            m_columns(std::pmr::vector<Ts>(memory)...)
+        {
+            std::apply([rows](auto &...column) { (column.reserve(rows), ...); }, m_columns);
+        }
+
+        /// Not copyable
+        typed_block(const typed_block &) = delete;
+        typed_block &operator = (const typed_block &) = delete;
+        /// Moveable
+        typed_block(typed_block &&) = default;
+        typed_block &operator = (typed_block &&) = default;
+
+        /// Returns true if the block contains data
+        operator bool () const {
+            return m_rows > 0;
+        }
+
+        /// The number of columns in each record
+        static constexpr std::size_t columns() {
+            return sizeof...(Ts);
+        }
+        /// The number of rows in the block
+        std::size_t size() const {
+            return m_rows;
+        }
+        /// The number of rows the block can hold
+        std::size_t capacity() const {
+            return m_capacity;
+        }
+
+        /// The total amount of memory held by the block
+        std::size_t memory_size() const {
+            return std::apply([](const auto &...column) {
+                return ((column.capacity() * sizeof(typename std::decay_t<decltype(column)>::value_type)) + ...);
+            }, m_columns);
+        }
+
+        /// The values of column `I`, one for each row
+        template<std::size_t I>
+        const auto &column() const {
+            return std::get<I>(m_columns);
+        }
+
+        /// Read and decode the next data row message. After a `NULL` has been
+        /// found in a column that isn't a `std::optional` the rows are read
+        /// but not kept.
+        template<typename S, typename Y>
+        void read_data_row(S &socket, std::size_t bytes, Y yield) {
+            assert(m_rows < m_capacity);
+            if ( bytes > max_row_size ) {
+                throw std::runtime_error("Data row is too large for the columns of the typed_block");
+            }
+            transfer(socket, row, bytes, yield);
+            if ( null_column == npos ) {
+                decode_row(bytes, std::index_sequence_for<Ts...>{});
+            }
+        }
+
+        /// Fill the block with data. Return zero if there is no more data to come
+        template<typename S, typename Y>
+        std::size_t read_rows(S &socket, std::size_t bytes, Y yield) {
+            return read_rows(socket, bytes, nullptr, yield);
+        }
+        /// Fill the block with data. If Postgres reports an error then it is
+        /// stored in `failed` (if given) and zero is returned. A `NULL` in
+        /// a column that can't hold it is thrown as `errc::unexpected_null`
+        /// once the rest of the recordset has been read, so the connection
+        /// can still be used.
+        template<typename S, typename Y>
+        std::size_t read_rows(
+            S &socket, std::size_t bytes, error_response *failed, Y yield
+        ) {
+            do {
+                read_data_row(socket, bytes, yield);
+                auto next = message_header(socket, failed, yield);
+                if ( next.type == 'D' ) {
+                    bytes = next.body_size;
+                } else if ( next.type == 'C' ) {
+                    next.message_body(socket, yield);
+                    if ( null_column != npos ) {
+                        throw boost::system::system_error(errc::unexpected_null,
+                            "NULL found in column " + std::to_string(null_column)
+                                + " which isn't a std::optional");
+                    }
+                    return 0;
+                } else if ( next.type == 'E' ) {
+                    return 0;
+                } else {
+                    throw std::logic_error(std::string("Unknown message type: ") + next.type);
+                }
+            } while ( m_rows < m_capacity || null_column != npos );
+            return bytes;
+        }
+    };
+
+
+    /// The values of column `I` of the block. This is easier to use than the
+    /// member in generic code, e.g. `pgasio::column<0>(block)`.
+    template<std::size_t I, typename... Ts>
+    const auto &column(const typed_block<Ts...> &block) {
+        return block.template column<I>();
+    }
+
+
+    /// Reads the rows of a recordset into `typed_block`s. The columns are
+    /// checked against the types when this is constructed, so the rows can
+    /// be decoded without checking them again. The query must have been
+    /// run with binary results.
+    template<typename S, typename... Ts>
+    class typed_recordset {
+        recordset<S> rs;
+        std::size_t rows;
+
+    public:
+        /// Throws if the recordset's columns don't match the types, after
+        /// skipping its rows so that the connection can still be used. Each
+        /// block holds up to `rows_per_block` rows.
+        template<typename Y>
+        typed_recordset(recordset<S> r, std::size_t rows_per_block, Y yield)
+        : rs(std::move(r)), rows(rows_per_block) {
+            const auto cols = rs.columns();
+            std::string mismatch;
+            if ( cols.size() != sizeof...(Ts) ) {
+                mismatch = "The recordset has " + std::to_string(cols.size())
+                    + " columns, but " + std::to_string(sizeof...(Ts)) + " were expected";
+            } else {
+                const std::array<int32_t, sizeof...(Ts)> oids{{
+                    binary_type<typename typed_column<Ts>::value_type>::oid...}};
+                for ( std::size_t c{}; c < cols.size() && mismatch.empty(); ++c ) {
+                    if ( cols[c].format_code != 1 ) {
+                        mismatch = "Column " + cols[c].name + " isn't in the binary format";
+                    } else if ( cols[c].field_type_oid != oids[c] ) {
+                        mismatch = "Column " + cols[c].name + " has type OID "
+                            + std::to_string(cols[c].field_type_oid) + ", but "
+                            + std::to_string(oids[c]) + " was expected";
+                    }
+                }
+            }
+            if ( mismatch.size() ) {
+                while ( rs.next_block(yield) );
+                throw std::runtime_error(mismatch);
+            }
+        }
+
+        /// The column meta data for this recordset
+        array_view<const column_meta> columns() const {
+            return rs.columns();
+        }
+
+        /// Returns the next block of rows, or an empty block when there
+        /// are no more
+        template<typename Y>
+        typed_block<Ts...> next_block(Y yield) {
+            return rs.read_block(typed_block<Ts...>{rows, rs.memory()}, yield);
+        }
+        /// As above, but errors are reported through `ec` in the same way
+        /// as `recordset::next_block`
+        template<typename Y>
+        typed_block<Ts...> next_block(boost::system::error_code &ec, Y yield) {
+            return rs.read_block(typed_block<Ts...>{rows, rs.memory()}, ec, yield);
+        }
+    };
+
+
+    /// Check the columns of the recordset and return a `typed_recordset`
+    /// for it, e.g. `auto rows = typed<int64_t, double>(rs, yield);`
+    template<typename... Ts, typename S, typename Y>
+    typed_recordset<S, Ts...> typed(recordset<S> rs, std::size_t rows_per_block, Y yield) {
+        return typed_recordset<S, Ts...>{std::move(rs), rows_per_block, yield};
+    }
+    template<typename... Ts, typename S, typename Y>
+    typed_recordset<S, Ts...> typed(recordset<S> rs, Y yield) {
+        return typed_recordset<S, Ts...>{std::move(rs), 16u << 10, yield};
+    }
+
+
+}
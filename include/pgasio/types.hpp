@@ -0,0 +1,288 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/query.hpp>
+
+#include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+
+namespace pgasio {
+
+
+    /// A field of a composite type
+    struct type_attribute {
+        std::string name;
+        int32_t oid;
+    };
+
+
+    /// The description of a type from `pg_type`
+    struct type_info {
+        int32_t oid;
+        std::string name;
+        /// The `typtype`: `b` base, `c` composite, `d` domain, `e` enum,
+        /// `p` pseudo-type, `r` range and `m` multi-range
+        char kind;
+        /// For arrays, the type of the elements, otherwise zero
+        int32_t element;
+        /// For domains, the type the domain is based on, otherwise zero
+        int32_t base;
+        /// The array type whose elements are this type, or zero
+        int32_t array;
+        /// The labels of an enum, in their sort order
+        std::vector<std::string> labels;
+        /// The fields of a composite type, in order
+        std::vector<type_attribute> attributes;
+    };
+
+
+    /// The types known to a database, looked up by OID or by name. The
+    /// built in types are always present. The rest, e.g. enums, domains and
+    /// composites, are added by `load_types`.
+    ///
+    /// Once loaded the registry is not changed, so a single
+    /// `std::shared_ptr<const type_registry>` can be shared by every
+    /// connection in a pool and used from any thread.
+    class type_registry {
+        std::unordered_map<int32_t, type_info> by_oid;
+        std::unordered_map<std::string, int32_t> by_name;
+
+    public:
+        /// A registry holding only the built in types
+        type_registry() {
+            struct builtin {
+                int32_t oid;
+                const char *name;
+                int32_t array;
+            };
+            static const builtin types[] = {
+                {16, "bool", 1000}, {17, "bytea", 1001}, {18, "char", 1002},
+                {19, "name", 1003}, {20, "int8", 1016}, {21, "int2", 1005},
+                {23, "int4", 1007}, {25, "text", 1009}, {26, "oid", 1028},
+                {114, "json", 199}, {142, "xml", 143}, {700, "float4", 1021},
+                {701, "float8", 1022}, {1042, "bpchar", 1014},
+                {1043, "varchar", 1015}, {1082, "date", 1182},
+                {1083, "time", 1183}, {1114, "timestamp", 1115},
+                {1184, "timestamptz", 1185}, {1186, "interval", 1187},
+                {1700, "numeric", 1231}, {2950, "uuid", 2951},
+                {3802, "jsonb", 3807}};
+            for ( const auto &t : types ) {
+                add(type_info{t.oid, t.name, 'b', 0, 0, t.array, {}, {}});
+                add(type_info{t.array, std::string("_") + t.name, 'b', t.oid, 0, 0, {}, {}});
+            }
+        }
+
+        /// Add or replace a type
+        void add(type_info type) {
+            by_name[type.name] = type.oid;
+            by_oid[type.oid] = std::move(type);
+        }
+
+        /// The number of types known
+        std::size_t size() const {
+            return by_oid.size();
+        }
+
+        /// Return the type, or `nullptr` if it isn't known
+        const type_info *find(int32_t oid) const {
+            const auto found = by_oid.find(oid);
+            return found == by_oid.end() ? nullptr : &found->second;
+        }
+        type_info *find(int32_t oid) {
+            const auto found = by_oid.find(oid);
+            return found == by_oid.end() ? nullptr : &found->second;
+        }
+        /// Return the type with this name. Type names are only unique
+        /// within a schema, so if more than one schema has a type with this
+        /// name then it's unspecified which is returned.
+        const type_info *find(const std::string &name) const {
+            const auto found = by_name.find(name);
+            return found == by_name.end() ? nullptr : find(found->second);
+        }
+
+        /// Follow domains back to the type that they are based on
+        int32_t underlying(int32_t oid) const {
+            auto type = find(oid);
+            while ( type && type->kind == 'd' && type->base ) {
+                oid = type->base;
+                type = find(oid);
+            }
+            return oid;
+        }
+    };
+
+
+    /// Load the types from the database's catalogue. The registry is cached
+    /// on the connection, so this only queries the database the first time
+    /// it is called. To share the registry across a pool of connections
+    /// assign it to the `types` member of the other connections, and to
+    /// pick up types created since it was loaded call it with `reload`.
+    template<typename S, typename Y> inline
+    std::shared_ptr<const type_registry> load_types(
+        connection<S> &cnx, Y yield, bool reload = false
+    ) {
+        if ( cnx.types && not reload ) return cnx.types;
+        auto types = std::make_shared<type_registry>();
+        auto types_query = queue_query(cnx,
+            "SELECT t.oid, t.typname, t.typtype, t.typcategory, t.typelem, "
+                "t.typbasetype, t.typarray, t.typrelid "
+            "FROM pg_catalog.pg_type t");
+        auto enums_query = queue_query(cnx,
+            "SELECT enumtypid, enumlabel FROM pg_catalog.pg_enum "
+            "ORDER BY enumtypid, enumsortorder");
+        auto attributes_query = queue_query(cnx,
+            "SELECT a.attrelid, a.attname, a.atttypid "
+            "FROM pg_catalog.pg_attribute a "
+                "JOIN pg_catalog.pg_type t ON t.typrelid = a.attrelid "
+            "WHERE t.typtype = 'c' AND a.attnum > 0 AND NOT a.attisdropped "
+            "ORDER BY a.attrelid, a.attnum");
+        flush(cnx, yield);
+
+        auto text = [](byte_view field) {
+            return std::string(reinterpret_cast<const char *>(field.data()), field.size());
+        };
+        auto number = [](byte_view field) {
+            int64_t value{};
+            const auto begin = reinterpret_cast<const char *>(field.data());
+            std::from_chars(begin, begin + field.size(), value);
+            return value;
+        };
+        /// Calls `row` with the fields of each row
+        auto rows = [](resultset<S> &results, auto row, Y yield) {
+            while ( auto rs = results.recordset(yield) ) {
+                const auto columns = rs.columns().size();
+                while ( auto block = rs.next_block(yield) ) {
+                    for ( auto fields = block.fields(); fields.size(); fields = fields.slice(columns) ) {
+                        row(fields);
+                    }
+                }
+            }
+        };
+
+        std::unordered_map<int32_t, int32_t> relations;
+        rows(types_query, [&](array_view<const byte_view> row) {
+            const int32_t oid = number(row[0]);
+            const char kind = row[2].size() ? row[2][0] : 'b';
+            const bool is_array = row[3].size() && row[3][0] == 'A';
+            const int32_t relation = number(row[7]);
+            if ( relation ) relations[relation] = oid;
+            types->add(type_info{oid, text(row[1]), kind,
+                is_array ? int32_t(number(row[4])) : 0,
+                int32_t(number(row[5])), int32_t(number(row[6])), {}, {}});
+        }, yield);
+        rows(enums_query, [&](array_view<const byte_view> row) {
+            if ( auto type = types->find(int32_t(number(row[0]))) ) {
+                type->labels.push_back(text(row[1]));
+            }
+        }, yield);
+        rows(attributes_query, [&](array_view<const byte_view> row) {
+            const auto composite = relations.find(number(row[0]));
+            if ( composite == relations.end() ) return;
+            if ( auto type = types->find(composite->second) ) {
+                type->attributes.push_back(type_attribute{text(row[1]), int32_t(number(row[2]))});
+            }
+        }, yield);
+
+        cnx.types = std::move(types);
+        return cnx.types;
+    }
+
+
+    /// Maps column types to a handler of type `D`, e.g. a function pointer,
+    /// an enum or an index into the caller's own table. The handler for a
+    /// column is worked out once, when the columns are known, after which
+    /// dispatching on a field is a plain array lookup.
+    ///
+    /// Handlers are registered for individual types, either by OID or by
+    /// name, and for whole categories of type. A type that has no handler
+    /// of its own is resolved using the registry: domains use the handler
+    /// of the type they're based on, and enums, composites and arrays use
+    /// the handler for their category. Anything else gets the fallback.
+    template<typename D>
+    class type_dispatch {
+        std::shared_ptr<const type_registry> registry;
+        std::unordered_map<int32_t, D> handlers;
+        std::optional<D> m_enums, m_composites, m_arrays;
+        D fallback;
+
+    public:
+        /// Without a registry only the handlers registered by OID can be
+        /// found, and everything else uses the fallback
+        explicit type_dispatch(D f, std::shared_ptr<const type_registry> r = {})
+        : registry{std::move(r)}, fallback{std::move(f)} {
+        }
+
+        /// Set the handler for a type
+        type_dispatch &add(int32_t oid, D handler) {
+            handlers[oid] = std::move(handler);
+            return *this;
+        }
+        /// Set the handler for a type using its name. The OIDs of types
+        /// that aren't built in differ between databases, so this is the
+        /// way to register handlers for custom types.
+        type_dispatch &add(const std::string &name, D handler) {
+            const auto type = registry ? registry->find(name) : nullptr;
+            if ( not type ) {
+                throw std::invalid_argument("Unknown Postgres type: " + name);
+            }
+            return add(type->oid, std::move(handler));
+        }
+
+        /// Set the handler for enums that don't have their own
+        type_dispatch &enums(D handler) {
+            m_enums = std::move(handler);
+            return *this;
+        }
+        /// Set the handler for composite types that don't have their own
+        type_dispatch &composites(D handler) {
+            m_composites = std::move(handler);
+            return *this;
+        }
+        /// Set the handler for array types that don't have their own
+        type_dispatch &arrays(D handler) {
+            m_arrays = std::move(handler);
+            return *this;
+        }
+
+        /// Return the handler for the type
+        const D &operator () (int32_t oid) const {
+            for ( std::size_t depth{}; depth < 32; ++depth ) {
+                const auto handler = handlers.find(oid);
+                if ( handler != handlers.end() ) return handler->second;
+                const auto type = registry ? registry->find(oid) : nullptr;
+                if ( not type ) break;
+                if ( type->kind == 'd' && type->base ) {
+                    oid = type->base;
+                } else if ( type->kind == 'e' && m_enums ) {
+                    return *m_enums;
+                } else if ( type->kind == 'c' && m_composites ) {
+                    return *m_composites;
+                } else if ( type->element && m_arrays ) {
+                    return *m_arrays;
+                } else {
+                    break;
+                }
+            }
+            return fallback;
+        }
+
+        /// Return the handler for each column, in column order
+        std::vector<D> columns(array_view<const column_meta> cols) const {
+            std::vector<D> table;
+            table.reserve(cols.size());
+            for ( const auto &col : cols ) table.push_back((*this)(col.field_type_oid));
+            return table;
+        }
+    };
+
+
+}
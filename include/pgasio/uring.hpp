@@ -0,0 +1,558 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#pragma once
+
+
+#include <pgasio/memory.hpp>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/asio/post.hpp>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <array>
+#include <memory>
+#include <system_error>
+
+
+namespace pgasio {
+
+
+    /// An io_uring submission and completion queue pair shared by all of the
+    /// sockets driven by one thread. Operations started during a turn of the
+    /// `io_service` are submitted together in a single system call at the
+    /// end of that turn, and the kernel signals completions through an
+    /// `eventfd` that the `io_service` watches.
+    ///
+    /// The ring also owns an arena of read buffers which is registered with
+    /// the kernel so that reads into them don't need the pages to be mapped
+    /// for every call. Each `uring_socket` takes one slot from this arena.
+    ///
+    /// A ring is not thread safe. It, and the sockets that use it, must only
+    /// be used from coroutines on a single thread and it must outlive all
+    /// of them. Destroying the ring cancels any operations still in flight
+    /// and waits for the kernel to finish with them.
+    class uring {
+    public:
+        /// An operation that has been submitted to the kernel. `complete` is
+        /// called with the result of the operation (a negative `errno`
+        /// on failure).
+        struct operation {
+            virtual ~operation() = default;
+            virtual void complete(int result) = 0;
+
+            /// The operations in flight are linked so they can be
+            /// cancelled when the ring is destroyed
+            operation *previous = nullptr, *next = nullptr;
+        };
+
+    private:
+        /// Closes the file descriptor when destroyed
+        struct descriptor {
+            int fd;
+            explicit descriptor(int f) : fd{f} {}
+            descriptor(const descriptor &) = delete;
+            descriptor &operator = (const descriptor &) = delete;
+            ~descriptor() { if ( fd >= 0 ) ::close(fd); }
+        };
+        /// Unmaps the memory when destroyed
+        struct mapping {
+            void *base = MAP_FAILED;
+            std::size_t size{};
+            mapping() = default;
+            mapping(const mapping &) = delete;
+            mapping &operator = (const mapping &) = delete;
+            ~mapping() { if ( base != MAP_FAILED ) ::munmap(base, size); }
+
+            void *map(std::size_t bytes, int prot, int flags, int fd, off_t offset, const char *what) {
+                base = ::mmap(nullptr, bytes, prot, flags, fd, offset);
+                if ( base == MAP_FAILED ) {
+                    throw std::system_error(errno, std::system_category(), what);
+                }
+                size = bytes;
+                return base;
+            }
+        };
+
+        boost::asio::io_service &ios;
+        io_uring_params params;
+        descriptor ring;
+        mapping sq_map, cq_map, sqe_map;
+        io_uring_sqe *sqes;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        io_uring_cqe *cqes;
+
+        boost::asio::posix::stream_descriptor event;
+        uint64_t event_count;
+        bool armed, flushing;
+        std::size_t queued, in_flight;
+
+        raw_memory arena;
+        std::size_t m_slot_size;
+        std::vector<std::size_t> free_slots;
+        bool registered;
+        mapping arena_map;
+
+        /// The operations that have been prepared but not yet completed
+        operation *outstanding = nullptr;
+        /// The handlers given to the `io_service` hold a weak pointer to
+        /// this so they do nothing if they run after the ring is destroyed
+        std::shared_ptr<uring> self{this, [](uring *) {}};
+
+        static int setup(unsigned entries, io_uring_params &p) {
+            const int fd = ::syscall(__NR_io_uring_setup, entries, &p);
+            if ( fd < 0 ) {
+                throw std::system_error(errno, std::system_category(), "io_uring_setup");
+            }
+            return fd;
+        }
+        static int open_eventfd() {
+            const int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if ( fd < 0 ) {
+                throw std::system_error(errno, std::system_category(), "eventfd");
+            }
+            return fd;
+        }
+        int enter(unsigned submit, unsigned wait, unsigned flags) {
+            return ::syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags, nullptr, 0);
+        }
+        int register_ring(unsigned opcode, const void *arg, unsigned count) {
+            return ::syscall(__NR_io_uring_register, ring.fd, opcode, arg, count);
+        }
+        template<typename T>
+        T *at(void *base, std::size_t offset) {
+            return reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(base) + offset);
+        }
+
+        /// Submit everything that has been queued so far
+        void submit() {
+            while ( queued ) {
+                const int done = enter(queued, 0, 0);
+                if ( done < 0 ) {
+                    if ( errno == EINTR || errno == EAGAIN || errno == EBUSY ) {
+                        reap();
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category(), "io_uring_enter");
+                }
+                queued -= done;
+            }
+        }
+        /// Deliver all of the completions that the kernel has posted
+        void reap() {
+            unsigned head = *cq_head;
+            while ( head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) ) {
+                const auto &cqe = cqes[head & *cq_mask];
+                auto op = reinterpret_cast<operation *>(cqe.user_data);
+                const auto result = cqe.res;
+                __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+                --in_flight;
+                /// Cancellations have no operation
+                if ( op ) {
+                    if ( op->previous ) op->previous->next = op->next;
+                    else outstanding = op->next;
+                    if ( op->next ) op->next->previous = op->previous;
+                    op->complete(result);
+                }
+            }
+        }
+        /// Watch the `eventfd` whilst there are operations in flight. Every
+        /// completion increments the `eventfd` so an armed read always
+        /// finishes after the last completion has been posted.
+        void arm() {
+            if ( armed || not in_flight ) return;
+            armed = true;
+            event.async_read_some(boost::asio::buffer(&event_count, sizeof(event_count)),
+                [weak = std::weak_ptr<uring>(self)](boost::system::error_code, std::size_t) {
+                    if ( auto ring = weak.lock() ) {
+                        ring->armed = false;
+                        ring->reap();
+                        ring->arm();
+                    }
+                });
+        }
+        /// Submit the queued operations once the current turn of the
+        /// `io_service` has finished starting them
+        void schedule() {
+            if ( flushing ) return;
+            flushing = true;
+            boost::asio::post(ios, [weak = std::weak_ptr<uring>(self)]() {
+                if ( auto ring = weak.lock() ) {
+                    ring->flushing = false;
+                    ring->submit();
+                    ring->reap();
+                    ring->arm();
+                }
+            });
+        }
+        /// Add an entry to the submission queue for the operation, which
+        /// is `nullptr` for a cancellation
+        io_uring_sqe &queue(operation *op) {
+            const unsigned tail = *sq_tail;
+            if ( tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == params.sq_entries ) {
+                /// The queue is full so it has to be submitted now
+                submit();
+            }
+            const auto index = tail & *sq_mask;
+            io_uring_sqe &sqe = sqes[index];
+            sqe = io_uring_sqe{};
+            sqe.user_data = reinterpret_cast<uint64_t>(op);
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            ++queued;
+            ++in_flight;
+            return sqe;
+        }
+        /// Cancel everything still in flight and wait until the kernel has
+        /// posted all of the completions, so that it no longer uses any of
+        /// the buffers or the rings
+        void drain() {
+            /// Queueing can reap completions, so the list is copied first
+            std::vector<operation *> cancelling;
+            for ( auto op = outstanding; op; op = op->next ) cancelling.push_back(op);
+            for ( auto op : cancelling ) {
+                auto &sqe = queue(nullptr);
+                sqe.opcode = IORING_OP_ASYNC_CANCEL;
+                sqe.addr = reinterpret_cast<uint64_t>(op);
+            }
+            submit();
+            while ( in_flight ) {
+                if ( enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR ) {
+                    throw std::system_error(errno, std::system_category(), "io_uring_enter");
+                }
+                reap();
+            }
+        }
+
+    public:
+        /// Create a ring able to hold `entries` operations at a time and an
+        /// arena of `slots` read buffers each `slot_size` bytes large.
+        explicit uring(
+            boost::asio::io_service &ios, unsigned entries = 256,
+            std::size_t slots = 64, std::size_t slot_size = 96 << 10
+        ) : ios(ios), params{}, ring{setup(entries, params)},
+            event{ios, open_eventfd()}, event_count{},
+            armed{false}, flushing{false}, queued{}, in_flight{},
+            m_slot_size{slot_size}, registered{false}
+        {
+            /// Everything acquired here is released by its holder if a
+            /// later step throws
+            auto sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            auto cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if ( single ) sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+            void *sq_base = sq_map.map(sq_map_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING, "io_uring mmap");
+            void *cq_base = single ? sq_base : cq_map.map(cq_map_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING, "io_uring mmap");
+            sqes = reinterpret_cast<io_uring_sqe *>(sqe_map.map(
+                params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES, "io_uring mmap"));
+            sq_head = at<unsigned>(sq_base, params.sq_off.head);
+            sq_tail = at<unsigned>(sq_base, params.sq_off.tail);
+            sq_mask = at<unsigned>(sq_base, params.sq_off.ring_mask);
+            sq_array = at<unsigned>(sq_base, params.sq_off.array);
+            cq_head = at<unsigned>(cq_base, params.cq_off.head);
+            cq_tail = at<unsigned>(cq_base, params.cq_off.tail);
+            cq_mask = at<unsigned>(cq_base, params.cq_off.ring_mask);
+            cqes = at<io_uring_cqe>(cq_base, params.cq_off.cqes);
+
+            const int efd = event.native_handle();
+            if ( register_ring(IORING_REGISTER_EVENTFD, &efd, 1) < 0 ) {
+                throw std::system_error(errno, std::system_category(), "io_uring eventfd");
+            }
+
+            const auto arena_size = slots * slot_size;
+            if ( arena_size ) {
+                void *memory = arena_map.map(arena_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0, "uring arena");
+                arena = raw_memory{reinterpret_cast<unsigned char *>(memory), arena_size};
+                /// Registering can fail if the arena is larger than the
+                /// locked memory limit. The buffers are then read into
+                /// without being registered.
+                const iovec region{arena.data(), arena.size()};
+                registered = register_ring(IORING_REGISTER_BUFFERS, &region, 1) == 0;
+                for ( auto slot = slots; slot; --slot ) free_slots.push_back(slot - 1);
+            }
+        }
+
+        /// Not copyable or movable
+        uring(const uring &) = delete;
+        uring &operator = (const uring &) = delete;
+
+        /// The memory and file descriptors are released by their holders
+        /// once the kernel has finished with them
+        ~uring() {
+            self.reset();
+            try {
+                drain();
+            } catch ( ... ) {
+                /// The ring can't be used any more, so all that can be done
+                /// is to release it
+            }
+        }
+
+        /// The `io_service` that completions are delivered through
+        boost::asio::io_service &get_io_service() {
+            return ios;
+        }
+
+        /// True if the read buffer arena is registered with the kernel
+        bool buffers_registered() const {
+            return registered;
+        }
+        /// The size of each of the read buffers
+        std::size_t slot_size() const {
+            return m_slot_size;
+        }
+
+        /// Take a read buffer from the arena. Returns -1 if they're all in use
+        int acquire_slot() {
+            if ( free_slots.empty() ) return -1;
+            const auto slot = free_slots.back();
+            free_slots.pop_back();
+            return slot;
+        }
+        /// Return the read buffer to the arena
+        void release_slot(int slot) {
+            if ( slot >= 0 ) free_slots.push_back(slot);
+        }
+        /// The memory for a read buffer slot
+        raw_memory slot_memory(int slot) {
+            return arena.slice(slot * m_slot_size, m_slot_size);
+        }
+
+        /// Return a cleared submission queue entry for the operation. It will
+        /// be submitted at the end of the current turn of the `io_service`.
+        io_uring_sqe &prepare(operation *op) {
+            io_uring_sqe &sqe = queue(op);
+            op->next = outstanding;
+            if ( outstanding ) outstanding->previous = op;
+            outstanding = op;
+            schedule();
+            return sqe;
+        }
+
+        /// Start an operation whose completion handler is called with
+        /// an error code and a byte count, in the same way as the Boost ASIO
+        /// asynchronous operations. `fill` is given the submission queue
+        /// entry to describe the operation. A zero byte read is reported
+        /// as the end of the file. Anything the kernel needs to read whilst
+        /// the operation is in flight can be kept alive by passing it as
+        /// `keep`.
+        template<typename Token, typename Fill>
+        auto start(
+            Token &&token, Fill fill, bool reading, std::shared_ptr<void> keep = {}
+        ) {
+            using signature = void(boost::system::error_code, std::size_t);
+            boost::asio::async_completion<Token, signature> completion{token};
+            using handler_type = std::decay_t<decltype(completion.completion_handler)>;
+
+            struct pending final : operation {
+                handler_type handler;
+                boost::asio::io_service::executor_type executor;
+                bool reading;
+                std::shared_ptr<void> keep;
+
+                pending(
+                    handler_type h, boost::asio::io_service &ios,
+                    bool r, std::shared_ptr<void> k
+                ) : handler(std::move(h)), executor(ios.get_executor()),
+                    reading{r}, keep(std::move(k))
+                {
+                }
+                void complete(int result) override {
+                    boost::system::error_code error;
+                    std::size_t bytes{};
+                    if ( result < 0 ) {
+                        error = boost::system::error_code(-result, boost::system::system_category());
+                    } else if ( result == 0 && reading ) {
+                        error = boost::asio::error::eof;
+                    } else {
+                        bytes = result;
+                    }
+                    auto handler_executor = boost::asio::get_associated_executor(handler, executor);
+                    boost::asio::post(handler_executor,
+                        [handler = std::move(handler), error, bytes]() mutable {
+                            handler(error, bytes);
+                        });
+                    delete this;
+                }
+            };
+
+            auto op = new pending{
+                std::move(completion.completion_handler), ios, reading, std::move(keep)};
+            fill(prepare(op));
+            return completion.result.get();
+        }
+
+        /// Read from the socket into a slot of the buffer arena
+        template<typename Token>
+        auto read_slot(int fd, int slot, Token &&token) {
+            const auto into = slot_memory(slot);
+            return start(std::forward<Token>(token), [this, fd, into](io_uring_sqe &sqe) {
+                sqe.opcode = registered ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+                sqe.fd = fd;
+                sqe.addr = reinterpret_cast<uint64_t>(into.data());
+                sqe.len = into.size();
+                sqe.buf_index = 0;
+            }, true);
+        }
+
+        /// Receive from the socket into any memory
+        template<typename Token>
+        auto recv(int fd, raw_memory into, Token &&token) {
+            return start(std::forward<Token>(token), [fd, into](io_uring_sqe &sqe) {
+                sqe.opcode = IORING_OP_RECV;
+                sqe.fd = fd;
+                sqe.addr = reinterpret_cast<uint64_t>(into.data());
+                sqe.len = into.size();
+            }, true);
+        }
+
+        /// Write a sequence of buffers to the socket. At most 16 buffers
+        /// are written at a time.
+        template<typename Buffers, typename Token>
+        auto writev(int fd, const Buffers &buffers, Token &&token) {
+            /// The `iovec`s must stay put until the operation completes
+            auto vectors = std::make_shared<std::array<iovec, 16>>();
+            std::size_t count{};
+            for ( auto b = boost::asio::buffer_sequence_begin(buffers);
+                b != boost::asio::buffer_sequence_end(buffers) && count < vectors->size(); ++b
+            ) {
+                const boost::asio::const_buffer buffer{*b};
+                if ( buffer.size() ) {
+                    (*vectors)[count++] = iovec{const_cast<void *>(buffer.data()), buffer.size()};
+                }
+            }
+            return start(std::forward<Token>(token), [fd, vectors, count](io_uring_sqe &sqe) {
+                sqe.opcode = IORING_OP_WRITEV;
+                sqe.fd = fd;
+                sqe.addr = reinterpret_cast<uint64_t>(vectors->data());
+                sqe.len = count;
+            }, false, vectors);
+        }
+    };
+
+
+    /// A socket whose reads and writes go through an io_uring. It reads into
+    /// a buffer taken from the ring's registered arena and can be used
+    /// anywhere a `buffered_socket` can be.
+    template<typename S>
+    class uring_socket {
+        uring *ring;
+        int slot;
+        std::vector<unsigned char> fallback;
+        raw_memory buffer, filled;
+    public:
+        /// The underlying socket, which keeps the file descriptor open
+        S socket;
+
+        /// Use the ring for the socket. If all of the ring's buffer slots
+        /// are in use then a buffer of the same size is allocated
+        uring_socket(uring &r, S s)
+        : ring{&r}, slot{r.acquire_slot()}, socket{std::move(s)} {
+            if ( slot >= 0 ) {
+                buffer = ring->slot_memory(slot);
+            } else {
+                fallback.resize(ring->slot_size());
+                buffer = raw_memory{fallback};
+            }
+        }
+        ~uring_socket() {
+            if ( ring ) ring->release_slot(slot);
+        }
+
+        /// Make non-copyable
+        uring_socket(const uring_socket &) = delete;
+        uring_socket &operator = (const uring_socket &) = delete;
+        /// Make movable
+        uring_socket(uring_socket &&s)
+        : ring{s.ring}, slot{s.slot}, fallback(std::move(s.fallback)),
+            buffer{s.buffer}, filled{s.filled}, socket{std::move(s.socket)}
+        {
+            s.ring = nullptr;
+            s.slot = -1;
+        }
+        uring_socket &operator = (uring_socket &&) = delete;
+
+        /// Read & transfer the requested number of bytes to the buffer. The
+        /// destination must be capable of storing the requested number of
+        /// bytes.
+        template<typename B, typename Y>
+        void transfer(B &dest, std::size_t bytes, Y yield) {
+            assert(bytes <= dest.size());
+            raw_memory into{dest};
+            while ( bytes ) {
+                if ( filled.size() ) {
+                    const auto transfer = std::min(bytes, filled.size());
+                    std::copy(filled.data(), filled.data() + transfer, into.data());
+                    filled = filled.slice(transfer);
+                    into = into.slice(transfer);
+                    bytes -= transfer;
+                } else if ( slot >= 0 ) {
+                    filled = buffer.slice(0, ring->read_slot(socket.native_handle(), slot, yield));
+                } else {
+                    filled = buffer.slice(0, ring->recv(socket.native_handle(), buffer, yield));
+                }
+            }
+        }
+
+        /// The number of bytes that have been read from the socket but not
+        /// yet transferred
+        std::size_t buffered() const {
+            return filled.size();
+        }
+
+        /// The Boost ASIO stream interface
+        using executor_type = boost::asio::io_service::executor_type;
+        executor_type get_executor() {
+            return ring->get_io_service().get_executor();
+        }
+        auto is_open() { return socket.is_open(); }
+
+        template<typename Buffers, typename Token>
+        auto async_read_some(const Buffers &buffers, Token &&token) {
+            const boost::asio::mutable_buffer into{*boost::asio::buffer_sequence_begin(buffers)};
+            return ring->recv(socket.native_handle(),
+                raw_memory{reinterpret_cast<unsigned char *>(into.data()), into.size()},
+                std::forward<Token>(token));
+        }
+        template<typename Buffers, typename Token>
+        auto async_write_some(const Buffers &buffers, Token &&token) {
+            return ring->writev(socket.native_handle(), buffers, std::forward<Token>(token));
+        }
+    };
+
+
+    /// Helper to create a `uring_socket` from a normal socket
+    template<typename S> inline
+    auto make_uring(uring &ring, S socket) {
+        return uring_socket<S>(ring, std::move(socket));
+    }
+
+
+    /// Overload for the transfer function that uses the io_uring socket
+    template<typename S, typename B, typename Y> inline
+    void transfer(
+        uring_socket<S> &source, B &buffer, std::size_t bytes, Y yield
+    ) {
+        source.transfer(buffer, bytes, yield);
+    }
+
+
+}
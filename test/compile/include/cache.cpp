@@ -0,0 +1,7 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#include <pgasio/cache.hpp>
+
@@ -0,0 +1,26 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#include <pgasio/channel.hpp>
+
+#include <boost/asio/spawn.hpp>
+
+
+/// The coroutines must be able to wait using the default `yield_context`,
+/// whatever its executor type is
+void channel_with_yield_context(
+    pgasio::channel<pgasio::record_block> &blocks, boost::asio::yield_context yield
+) {
+    blocks.produce(pgasio::record_block{}, 1u, yield);
+    blocks.consume(yield);
+}
+
+
+void waiting_with_yield_context(
+    pgasio::waiting &waiters, std::mutex &mutex, boost::asio::yield_context yield
+) {
+    std::unique_lock<std::mutex> lock{mutex};
+    waiters.wait(lock, yield);
+}
@@ -0,0 +1,15 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#include <pgasio/router.hpp>
+
+#include <boost/asio/local/stream_protocol.hpp>
+
+
+/// The health checks run on the router's strand and pass its `yield` to
+/// the connectors, which take the default `yield_context`
+void monitor_endpoints(pgasio::router<boost::asio::local::stream_protocol::socket> &endpoints) {
+    endpoints.monitor(std::chrono::seconds{1});
+}
@@ -0,0 +1,13 @@
+/**
+    Copyright 2018, Kirit Sælensminde. <https://kirit.com/pgasio/>
+*/
+
+
+#include <pgasio/sharded.hpp>
+
+
+/// Calling across shards must work with the default `yield_context`
+int call_with_yield_context(pgasio::sharded &shards, boost::asio::yield_context yield) {
+    shards.call(0, [](auto) {}, yield);
+    return shards.call(0, [](auto) { return 1; }, yield);
+}